@@ -0,0 +1,426 @@
+
+// Executable image tuned atom quality tables
+#include "stdafx.h"
+#include "AtomQuality.h"
+#include "RuleLoader.h"
+#include <yara/ahocorasick.h>
+
+#define TABLE_ENTRIES 65536			// Most common 4-grams kept in the table
+#define PREFIX_RANK (TABLE_ENTRIES * 4)	// 3-gram count rank a 4-gram prefix needs to be counted
+#define HASH_BITS 22				// 4-gram count hash table slots, 4M
+#define MAX_CORPUS_FILE (512ull * 1024 * 1024)
+
+// 4-gram count slot, empty when the count is zero
+struct GRAM_COUNT
+{
+	UINT32 gram;	// Atom bytes, first byte in the high bits so numeric order is libyara's memcmp() table order
+	UINT32 count;
+};
+
+// The files in a corpus folder and its subfolders
+static void GetCorpusFiles(__in LPCWSTR folder, __inout qvector<qwstring> &files, __inout UINT64 &bytes)
+{
+	qwstring pattern(folder);
+	pattern += L"\\*";
+	WIN32_FIND_DATAW fd;
+	HANDLE find = FindFirstFileW(pattern.c_str(), &fd);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		if ((wcscmp(fd.cFileName, L".") == 0) || (wcscmp(fd.cFileName, L"..") == 0))
+			continue;
+		qwstring path(folder);
+		path += L"\\";
+		path += fd.cFileName;
+
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			// Not through links, they can loop
+			if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+				GetCorpusFiles(path.c_str(), files, bytes);
+		}
+		else
+		{
+			UINT64 size = (((UINT64) fd.nFileSizeHigh << 32) | fd.nFileSizeLow);
+			if ((size >= 4) && (size <= MAX_CORPUS_FILE))
+			{
+				files.push_back(path);
+				bytes += size;
+			}
+		}
+	} while (FindNextFileW(find, &fd));
+	FindClose(find);
+}
+
+// Map a corpus file and pass its bytes to "counter". Returns FALSE if it couldn't be read.
+template <class T> static BOOL CountFile(__in LPCWSTR path, T counter)
+{
+	BOOL result = FALSE;
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(file, &size) && (size.QuadPart >= 4))
+	{
+		if (HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL))
+		{
+			if (LPCVOID view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0))
+			{
+				counter((const BYTE*) view, (size_t) size.QuadPart);
+				UnmapViewOfFile(view);
+				result = TRUE;
+			}
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+	return result;
+}
+
+static inline UINT32 HashSlot(UINT32 gram) { return ((gram * 0x9E3779B1) >> (32 - HASH_BITS)); }
+
+BOOL BuildAtomQualityTable(__in LPCSTR corpusFolder, __in LPCSTR tablePath)
+{
+	BOOL success = FALSE;
+	FILE *fp = NULL;
+	WaitBox::show("Yara for IDA", "Counting corpus n-grams..", "url(" STYLE_PATH "progress-style.qss)", STYLE_PATH "icon.png");
+	WaitBox::updateAndCancelCheck(0);
+
+	try
+	{
+		char numBuff[32];
+		TIMESTAMP startTime = GetTimeStamp();
+		qwstring wideFolder;
+		utf8_utf16(&wideFolder, corpusFolder);
+		qvector<qwstring> files;
+		UINT64 corpusBytes = 0;
+		GetCorpusFiles(wideFolder.c_str(), files, corpusBytes);
+		if (files.empty())
+		{
+			msg(MSG_TAG "* No corpus files in \"%s\" *\n", corpusFolder);
+			goto exit;
+		}
+		msg("\n" MSG_TAG "Building an atom quality table from %s files, %s, in \"%s\":\n", NumberCommaString(files.size(), numBuff), byteSizeString(corpusBytes), corpusFolder);
+		REFRESH_UI();
+
+		// 1) Exact 3-gram counts
+		std::vector<UINT32> triCounts(1 << 24, 0);
+		UINT64 bytesDone = 0, total4 = 0;
+		UINT32 readFailed = 0;
+		for (const qwstring &path : files)
+		{
+			BOOL read = CountFile(path.c_str(), [&](const BYTE *data, size_t size)
+			{
+				UINT32 gram = ((data[0] << 8) | data[1]);
+				for (size_t i = 2; i < size; i++)
+				{
+					gram = (((gram << 8) | data[i]) & 0xFFFFFF);
+					UINT32 &count = triCounts[gram];
+					if (count != MAXUINT32)
+						count++;
+				}
+				bytesDone += size;
+			});
+			if (!read)
+				readFailed++;
+			if (WaitBox::isUpdateTime() && WaitBox::updateAndCancelCheck((int) ((bytesDone * 50) / corpusBytes)))
+			{
+				msg("- Canceled -\n");
+				goto exit;
+			}
+		}
+
+		// The prefix count a 4-gram needs to be a candidate, from the 3-gram count ranks
+		UINT32 threshold = 1;
+		{
+			std::vector<UINT32> ranked;
+			for (UINT32 count : triCounts)
+			{
+				if (count)
+					ranked.push_back(count);
+			}
+			if (ranked.size() > PREFIX_RANK)
+			{
+				std::nth_element(ranked.begin(), (ranked.begin() + (PREFIX_RANK - 1)), ranked.end(), std::greater<UINT32>());
+				threshold = max(ranked[PREFIX_RANK - 1], 1u);
+			}
+		}
+
+		// 2) 4-gram counts for the candidates
+		WaitBox::setLabelText("Counting corpus 4-grams..");
+		std::vector<GRAM_COUNT> slots((size_t) 1 << HASH_BITS, GRAM_COUNT{ 0, 0 });
+		const size_t maxUsed = ((slots.size() * 9) / 10);
+		size_t used = 0;
+		bytesDone = 0;
+		for (const qwstring &path : files)
+		{
+			CountFile(path.c_str(), [&](const BYTE *data, size_t size)
+			{
+				UINT32 gram = ((data[0] << 16) | (data[1] << 8) | data[2]);
+				for (size_t i = 3; i < size; i++)
+				{
+					gram = ((gram << 8) | data[i]);
+					total4++;
+					if (triCounts[gram >> 8] < threshold)
+						continue;
+
+					// Linear probe, once full only the 4-grams already in are counted
+					for (UINT32 slot = HashSlot(gram);; slot = ((slot + 1) & ((1 << HASH_BITS) - 1)))
+					{
+						GRAM_COUNT &entry = slots[slot];
+						if (entry.count == 0)
+						{
+							if (used < maxUsed)
+							{
+								entry.gram = gram;
+								entry.count = 1;
+								used++;
+							}
+							break;
+						}
+						if (entry.gram == gram)
+						{
+							if (entry.count != MAXUINT32)
+								entry.count++;
+							break;
+						}
+					}
+				}
+				bytesDone += size;
+			});
+			if (WaitBox::isUpdateTime() && WaitBox::updateAndCancelCheck((int) (50 + ((bytesDone * 50) / corpusBytes))))
+			{
+				msg("- Canceled -\n");
+				goto exit;
+			}
+		}
+		std::vector<UINT32>().swap(triCounts);
+
+		// Keep the most common, scored by their information bits
+		std::vector<GRAM_COUNT> top;
+		top.reserve(used);
+		for (const GRAM_COUNT &entry : slots)
+		{
+			if (entry.count)
+				top.push_back(entry);
+		}
+		std::vector<GRAM_COUNT>().swap(slots);
+		size_t keep = min(top.size(), (size_t) TABLE_ENTRIES);
+		std::partial_sort(top.begin(), (top.begin() + keep), top.end(), [](const GRAM_COUNT &a, const GRAM_COUNT &b) { return (a.count > b.count); });
+		top.resize(keep);
+		if (top.empty() || (total4 == 0))
+		{
+			msg(MSG_TAG "* The corpus files are too small *\n");
+			goto exit;
+		}
+
+		msg(" Most common 4-grams:\n");
+		for (size_t i = 0; i < min(keep, (size_t) 8); i++)
+		{
+			double share = ((double) top[i].count / (double) total4);
+			msg("  %02X %02X %02X %02X  %.3f%%\n", (top[i].gram >> 24), ((top[i].gram >> 16) & 0xFF), ((top[i].gram >> 8) & 0xFF), (top[i].gram & 0xFF), (share * 100.0));
+		}
+
+		std::sort(top.begin(), top.end(), [](const GRAM_COUNT &a, const GRAM_COUNT &b) { return (a.gram < b.gram); });
+		// Raw entries, YR_ATOM_QUALITY_TABLE_ENTRY has const members
+		const size_t entrySize = sizeof(YR_ATOM_QUALITY_TABLE_ENTRY);
+		std::vector<BYTE> table(top.size() * entrySize);
+		for (size_t i = 0; i < top.size(); i++)
+		{
+			// About 8 per bit, a uniformly random 4 byte atom being 32 bits and the top quality
+			double bits = -log2((double) top[i].count / (double) total4);
+			int quality = (int) (bits * 8.0);
+			BYTE *entry = &table[i * entrySize];
+			entry[0] = (BYTE) (top[i].gram >> 24);
+			entry[1] = (BYTE) (top[i].gram >> 16);
+			entry[2] = (BYTE) (top[i].gram >> 8);
+			entry[3] = (BYTE) top[i].gram;
+			entry[YR_MAX_ATOM_LENGTH] = (BYTE) min(max(quality, YR_MIN_ATOM_QUALITY), YR_MAX_ATOM_QUALITY);
+		}
+
+		qwstring widePath;
+		utf8_utf16(&widePath, tablePath);
+		errno_t err = _wfopen_s(&fp, widePath.c_str(), L"wbS");
+		if (err != 0)
+		{
+			char buffer[1024];
+			strerror_s(buffer, sizeof(buffer), err);
+			msg(MSG_TAG "** Failed to create \"%s\": \"%s\" **\n", tablePath, buffer);
+			goto exit;
+		}
+		if (fwrite(table.data(), entrySize, top.size(), fp) != top.size())
+		{
+			msg(MSG_TAG "** Failed to write \"%s\" **\n", tablePath);
+			goto exit;
+		}
+
+		if (readFailed)
+			msg(" (%u corpus files couldn't be read)\n", readFailed);
+		msg(MSG_TAG "Saved %s atom quality entries to \"%s\" in %s\n", NumberCommaString(top.size(), numBuff), tablePath, TimeString(GetTimeStamp() - startTime));
+		success = TRUE;
+	}
+	CATCH()
+
+	exit:;
+	if (fp)
+	{
+		fclose(fp);
+		if (!success)
+		{
+			qwstring widePath;
+			utf8_utf16(&widePath, tablePath);
+			DeleteFileW(widePath.c_str());
+		}
+	}
+	WaitBox::hide();
+	return success;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// Walk the rules' Aho-Corasick automaton over the data the same way the libyara scanner does, counting the atom hits
+// it would verify
+static UINT64 CountCandidates(__in YR_RULES *rules, __in_bcount(size) const BYTE *data, size_t size)
+{
+	const YR_AC_TRANSITION *transitions = rules->ac_transition_table;
+	const UINT32 *matchTable = rules->ac_match_table;
+	UINT64 candidates = 0;
+	UINT32 state = YR_AC_ROOT_STATE;
+	size_t i = 0;
+
+	for (;;)
+	{
+		if (matchTable[state])
+		{
+			for (YR_AC_MATCH *match = &rules->ac_match_pool[matchTable[state] - 1]; match; match = match->next)
+			{
+				if (match->backtrack <= i)
+					candidates++;
+			}
+		}
+		if (i >= size)
+			break;
+
+		UINT32 index = (data[i++] + 1);
+		YR_AC_TRANSITION transition = transitions[state + index];
+		while (YR_AC_INVALID_TRANSITION(transition, index))
+		{
+			if (state != YR_AC_ROOT_STATE)
+			{
+				state = YR_AC_NEXT_STATE(transitions[state]);
+				transition = transitions[state + index];
+			}
+			else
+			{
+				transition = 0;
+				break;
+			}
+		}
+		state = YR_AC_NEXT_STATE(transition);
+	}
+	return candidates;
+}
+
+static int BenchmarkScanCallback(__in YR_SCAN_CONTEXT *context, int message, __in void *message_data, __in void *user_data)
+{
+	if (message == CALLBACK_MSG_RULE_MATCHING)
+		(*((UINT64*) user_data))++;
+	return CALLBACK_CONTINUE;
+}
+
+struct BENCHMARK_RESULT
+{
+	UINT64 candidates;
+	UINT64 ruleHits;	// Matching rules, summed per segment
+	TIMESTAMP compileTime;
+	TIMESTAMP scanTime;
+};
+
+static BOOL RunBenchmark(__in const qstrvec_t &paths, __in_opt LPCSTR atomTable, __in const std::vector<std::vector<BYTE>> &segments, __out BENCHMARK_RESULT &result)
+{
+	memset(&result, 0, sizeof(result));
+	for (const qstring &path : paths)
+	{
+		TIMESTAMP startTime = GetTimeStamp();
+		YR_RULES *rules = CompileRulesUncached(path.c_str(), atomTable);
+		if (!rules)
+			return FALSE;
+		result.compileTime += (GetTimeStamp() - startTime);
+
+		for (const std::vector<BYTE> &bytes : segments)
+		{
+			result.candidates += CountCandidates(rules, bytes.data(), bytes.size());
+
+			startTime = GetTimeStamp();
+			yr_rules_scan_mem(rules, bytes.data(), bytes.size(), SCAN_FLAGS_REPORT_RULES_MATCHING, BenchmarkScanCallback, &result.ruleHits, 0);
+			result.scanTime += (GetTimeStamp() - startTime);
+		}
+		yr_rules_destroy(rules);
+		if (WaitBox::updateAndCancelCheck())
+			return FALSE;
+	}
+	return TRUE;
+}
+
+void AtomQualityBenchmark(__in const qstrvec_t &paths, __in LPCSTR tablePath)
+{
+	WaitBox::show("Yara for IDA", "Atom quality benchmark..", "url(" STYLE_PATH "progress-style.qss)", STYLE_PATH "icon.png");
+	WaitBox::updateAndCancelCheck(-1);
+
+	try
+	{
+		// Mirror the scanned segment types, like the scan does
+		std::vector<std::vector<BYTE>> segments;
+		UINT64 bytesTotal = 0;
+		int count = get_segm_qty();
+		for (int i = 0; i < count; i++)
+		{
+			segment_t *seg = getnseg(i);
+			if (!seg || (seg->size() == 0))
+				continue;
+			switch (seg->type)
+			{
+				case SEG_XTRN:
+				case SEG_GRP:
+				case SEG_NULL:
+				case SEG_UNDF:
+				case SEG_ABSSYM:
+				case SEG_COMM:
+				case SEG_IMEM:
+				continue;
+			};
+
+			segments.emplace_back();
+			std::vector<BYTE> &bytes = segments.back();
+			bytes.resize((size_t) seg->size());
+			PBYTE ptr = bytes.data();
+			for (ea_t ea = seg->start_ea; ea < seg->end_ea; ++ea, ++ptr)
+				*ptr = get_db_byte(ea);
+			bytesTotal += bytes.size();
+		}
+
+		msg("\n" MSG_TAG "Atom quality benchmark, %u segments, %s, single thread:\n", (UINT32) segments.size(), byteSizeString(bytesTotal));
+		REFRESH_UI();
+		BENCHMARK_RESULT heuristic, table;
+		if (!RunBenchmark(paths, NULL, segments, heuristic) || !RunBenchmark(paths, tablePath, segments, table))
+		{
+			msg("- Benchmark canceled or failed -\n");
+			WaitBox::hide();
+			return;
+		}
+
+		char numBuff1[32], numBuff2[32];
+		msg(" Heuristic atoms: %s candidate verifications, scan %s", NumberCommaString(heuristic.candidates, numBuff1), TimeString(heuristic.scanTime));
+		msg(", compile %s, %s rule hits\n", TimeString(heuristic.compileTime), NumberCommaString(heuristic.ruleHits, numBuff2));
+		msg(" Table atoms:     %s candidate verifications (%.2fx), scan %s", NumberCommaString(table.candidates, numBuff1),
+			(heuristic.candidates ? ((double) table.candidates / (double) heuristic.candidates) : 0.0), TimeString(table.scanTime));
+		msg(" (%.2fx), compile %s, %s rule hits\n", ((heuristic.scanTime > 0.0) ? (table.scanTime / heuristic.scanTime) : 0.0), TimeString(table.compileTime), NumberCommaString(table.ruleHits, numBuff2));
+		if (table.ruleHits != heuristic.ruleHits)
+			msg(MSG_TAG "** The rule hits differ, atom choice should never change the matches **\n");
+	}
+	CATCH()
+	WaitBox::hide();
+}
@@ -0,0 +1,32 @@
+
+// Executable image tuned atom quality tables
+#pragma once
+
+#include "stdafx.h"
+
+/*
+libyara picks the atoms (the up to 4 byte string pieces fed to its Aho-Corasick automaton) for each rule string by a
+quality score. Every place an atom occurs in the scanned data is a candidate the scanner has to verify against the
+whole string, so an atom that's common in the data costs a verification at each occurrence.
+The default heuristic scores the bytes by themselves plus a bonus for distinct ones, only knowing a fixed few as common:
+00, 20, 90, CC, and FF score lower, and an atom of just one of them repeated is penalized further. Everything else is
+scored the same, but in code and data images atoms like "01 00 00 00", "00 00 FF FF", "8B 45 xx", "48 8B xx", and
+"FF 15 xx xx" are common far beyond what that assumes.
+
+A table built from real binaries scores atoms by how often they actually occur instead: the 4-grams counted over a
+corpus folder of executables, the most common ones getting a quality of about 8 per bit of information
+(-log2 of the 4-gram frequency). Atoms not in the table are rare and get the top quality.
+Counting is two passes over the corpus: exact 3-gram counts first, then 4-gram counts only for the 4-grams with a
+common enough 3-gram prefix, since only those can be among the most common 4-grams.
+
+Table file: the libyara YR_ATOM_QUALITY_TABLE_ENTRY array as is, sorted by atom bytes; 4 atom bytes then the quality.
+Compile with one using the "atomtable=" plugin option.
+*/
+
+// Build an atom quality table from all the files in a folder (recursively), saving it to "tablePath".
+// Shows a cancelable wait box, returns TRUE on success.
+BOOL BuildAtomQualityTable(__in LPCSTR corpusFolder, __in LPCSTR tablePath);
+
+// Compare the libyara heuristic atoms against an atom quality table on the current IDB: compile each rules file both
+// ways, then count the scanner candidate verifications and time a single thread scan of the segments for each.
+void AtomQualityBenchmark(__in const qstrvec_t &paths, __in LPCSTR tablePath);
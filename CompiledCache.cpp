@@ -0,0 +1,435 @@
+
+// Compiled rules disk cache
+#include "stdafx.h"
+#include "CompiledCache.h"
+#include "Hash.h"
+#include "RuleLoader.h"
+
+extern BOOL optionVerbose;
+extern LPCSTR YaraStatusString(int error);
+
+#define CACHE_FOLDER    "yara4ida_cache"
+#define CACHE_SIGNATURE 0x43493459 // "Y4IC"
+#define CACHE_VERSION   2
+
+// Stream adaptors for yr_rules_save_stream()/yr_rules_load_stream()
+static size_t StreamRead(__out_bcount(size * count) void *ptr, size_t size, size_t count, __in void *user_data)
+{
+	return fread(ptr, size, count, (FILE*) user_data);
+}
+
+static size_t StreamWrite(__in_bcount(size * count) const void *ptr, size_t size, size_t count, __in void *user_data)
+{
+	return fwrite(ptr, size, count, (FILE*) user_data);
+}
+
+// Libyara arena format, libyara version, and plugin build identity
+static UINT64 BuildKey()
+{
+	UINT64 key = FNV64_BASIS;
+	UINT32 value = YR_ARENA_FILE_VERSION;
+	key = fnv64(key, &value, sizeof(value));
+	value = YR_VERSION_HEX;
+	key = fnv64(key, &value, sizeof(value));
+
+	// Our module's PE header link time stamp and image size, changes with every build
+	HMODULE myModule = NULL;
+	if (GetModuleHandleExA((GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT | GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS), (LPCSTR) &BuildKey, &myModule))
+	{
+		PIMAGE_NT_HEADERS ntHeader = (PIMAGE_NT_HEADERS) ((PBYTE) myModule + ((PIMAGE_DOS_HEADER) myModule)->e_lfanew);
+		key = fnv64(key, &ntHeader->FileHeader.TimeDateStamp, sizeof(ntHeader->FileHeader.TimeDateStamp));
+		key = fnv64(key, &ntHeader->OptionalHeader.SizeOfImage, sizeof(ntHeader->OptionalHeader.SizeOfImage));
+	}
+	return key;
+}
+
+// Build key for rules compiled into a namespace with the given compiler settings
+static UINT64 CompileKey(__in LPCSTR ns, UINT64 options)
+{
+	UINT64 key = fnv64(BuildKey(), ns);
+	if (options)
+		key = fnv64(key, &options, sizeof(options));
+	return key;
+}
+
+// Cache file path for a root rules file compiled into a namespace, optionally creating the cache folder
+static void GetCachePath(__in LPCSTR rootPath, __in LPCSTR ns, UINT64 options, __out qwstring &path, BOOL create = FALSE)
+{
+	// Paths are case insensitive
+	qstring lower(rootPath);
+	lower.make_lower();
+
+	qstring folder;
+	folder.sprnt("%s\\" CACHE_FOLDER, get_user_idadir());
+	utf8_utf16(&path, folder.c_str());
+	if (create)
+		CreateDirectoryW(path.c_str(), NULL);
+
+	qstring name;
+	UINT64 hash = fnv64(fnv64(FNV64_BASIS, lower.c_str()), ns);
+	if (options)
+		hash = fnv64(hash, &options, sizeof(options));
+	name.sprnt("\\%016llX.yarc", hash);
+	qwstring wideName;
+	utf8_utf16(&wideName, name.c_str());
+	path += wideName;
+}
+
+BOOL HashRuleFile(__in LPCSTR path, __out UINT64 &hash)
+{
+	BOOL success = FALSE;
+	FILE *fp = NULL;
+	LPBYTE buffer = NULL;
+
+	try
+	{
+		qwstring widePath;
+		utf8_utf16(&widePath, path);
+		if (_wfopen_s(&fp, widePath.c_str(), L"rbS") != 0)
+			goto exit;
+
+		long fileSize = fsize(fp);
+		if (fileSize == -1)
+			goto exit;
+
+		buffer = (LPBYTE) _aligned_malloc(((size_t) fileSize + 1), 32);
+		if (!buffer)
+			goto exit;
+
+		if ((fileSize > 0) && (fread(buffer, (size_t) fileSize, 1, fp) != 1))
+			goto exit;
+
+		hash = HashRuleText(buffer, (size_t) fileSize);
+		success = TRUE;
+	}
+	CATCH()
+
+	exit:;
+	if (fp)
+		fclose(fp);
+	if (buffer)
+		_aligned_free(buffer);
+	return success;
+}
+
+void AddRuleSource(__inout RULE_SOURCES &sources, __in LPCSTR path, UINT64 hash)
+{
+	for (const RULE_SOURCE &source : sources)
+	{
+		if (_stricmp(source.path.c_str(), path) == 0)
+			return;
+	}
+	RULE_SOURCE &source = sources.push_back();
+	source.path = path;
+	source.hash = hash;
+}
+
+BOOL LoadCompiledRules(__in LPCSTR rootPath, __in LPCSTR ns, UINT64 options, __out YR_RULES **rules, __out_opt RULE_SOURCES *sources, HASH_RULE_FILE hashFile)
+{
+	*rules = NULL;
+	if (sources)
+		sources->clear();
+	BOOL valid = FALSE;
+	FILE *fp = NULL;
+	qwstring cachePath;
+
+	try
+	{
+		GetCachePath(rootPath, ns, options, cachePath);
+		if (_wfopen_s(&fp, cachePath.c_str(), L"rbS") != 0)
+			return FALSE;
+
+		// Header
+		UINT32 signature = 0, version = 0, sourceCount = 0;
+		UINT64 key = 0;
+		if ((fread(&signature, sizeof(signature), 1, fp) != 1) || (signature != CACHE_SIGNATURE) ||
+			(fread(&version, sizeof(version), 1, fp) != 1) || (version != CACHE_VERSION) ||
+			(fread(&key, sizeof(key), 1, fp) != 1) || (key != CompileKey(ns, options)) ||
+			(fread(&sourceCount, sizeof(sourceCount), 1, fp) != 1) || (sourceCount == 0))
+			goto exit;
+
+		// Every source must still have the same contents
+		for (UINT32 i = 0; i < sourceCount; i++)
+		{
+			UINT32 length = 0;
+			if ((fread(&length, sizeof(length), 1, fp) != 1) || (length == 0) || (length >= MAX_PATH))
+				goto exit;
+			char path[MAX_PATH];
+			UINT64 hash = 0, current = 0;
+			if ((fread(path, length, 1, fp) != 1) || (fread(&hash, sizeof(hash), 1, fp) != 1))
+				goto exit;
+			path[length] = 0;
+
+			if ((i == 0) && (_stricmp(path, rootPath) != 0))
+				goto exit;
+			if (!hashFile(path, current) || (current != hash))
+				goto exit;
+			if (sources)
+				AddRuleSource(*sources, path, hash);
+		}
+
+		YR_STREAM stream = { fp, StreamRead, NULL };
+		int yaraResult = yr_rules_load_stream(&stream, rules);
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			RuleMsg(MSG_TAG "* Compiled rules cache load failed with: %s, recompiling *\n", YaraStatusString(yaraResult));
+			*rules = NULL;
+			goto exit;
+		}
+		valid = TRUE;
+	}
+	CATCH()
+
+	exit:;
+	if (fp)
+		fclose(fp);
+	if (!valid)
+	{
+		// Stale or bad, delete it so a compile can replace it
+		if (*rules)
+		{
+			yr_rules_destroy(*rules);
+			*rules = NULL;
+		}
+		if (!cachePath.empty())
+			DeleteFileW(cachePath.c_str());
+		if (sources)
+			sources->clear();
+	}
+	return valid;
+}
+
+BOOL SaveCompiledRules(__in const RULE_SOURCES &sources, __in LPCSTR ns, UINT64 options, __in YR_RULES *rules)
+{
+	BOOL success = FALSE;
+	FILE *fp = NULL;
+	qwstring cachePath, tempPath;
+
+	try
+	{
+		if (sources.empty())
+			return FALSE;
+
+		// Write to a temporary file then swap it in, so a failed write never leaves a half cache file behind
+		GetCachePath(sources[0].path.c_str(), ns, options, cachePath, TRUE);
+		tempPath = cachePath;
+		tempPath += L".tmp";
+		if (_wfopen_s(&fp, tempPath.c_str(), L"wbS") != 0)
+			return FALSE;
+
+		UINT32 value = CACHE_SIGNATURE;
+		fwrite(&value, sizeof(value), 1, fp);
+		value = CACHE_VERSION;
+		fwrite(&value, sizeof(value), 1, fp);
+		UINT64 key = CompileKey(ns, options);
+		fwrite(&key, sizeof(key), 1, fp);
+		value = (UINT32) sources.size();
+		fwrite(&value, sizeof(value), 1, fp);
+		for (const RULE_SOURCE &source : sources)
+		{
+			value = (UINT32) source.path.length();
+			fwrite(&value, sizeof(value), 1, fp);
+			fwrite(source.path.c_str(), value, 1, fp);
+			fwrite(&source.hash, sizeof(source.hash), 1, fp);
+		}
+
+		YR_STREAM stream = { fp, NULL, StreamWrite };
+		int yaraResult = yr_rules_save_stream(rules, &stream);
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			RuleMsg(MSG_TAG "* Compiled rules cache save failed with: %s *\n", YaraStatusString(yaraResult));
+			goto exit;
+		}
+
+		success = (ferror(fp) == 0);
+		fclose(fp);
+		fp = NULL;
+		if (success)
+			success = MoveFileExW(tempPath.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING);
+	}
+	CATCH()
+
+	exit:;
+	if (fp)
+		fclose(fp);
+	if (!success && !tempPath.empty())
+		DeleteFileW(tempPath.c_str());
+	return success;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// Rule image path, the rules file's extension replaced
+static void GetImagePath(__in LPCSTR path, __out qwstring &imagePath)
+{
+	WCHAR buffer[MAX_PATH];
+	qwstring widePath;
+	utf8_utf16(&widePath, path);
+	wcsncpy_s(buffer, _countof(buffer), widePath.c_str(), _TRUNCATE);
+	PathRenameExtensionW(buffer, RULE_IMAGE_EXTENSION);
+	imagePath = buffer;
+}
+
+// The modules a rules file imports, from its 'import "name"' lines
+static void GetImports(__in LPCSTR path, __out qstrvec_t &modules)
+{
+	modules.clear();
+	FILE *fp = NULL;
+	qwstring widePath;
+	utf8_utf16(&widePath, path);
+	if (_wfopen_s(&fp, widePath.c_str(), L"rtS") != 0)
+		return;
+
+	char line[1024], name[128];
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (GetImportName(line, name, sizeof(name)) && !modules.has(name))
+			modules.push_back(name);
+	}
+	fclose(fp);
+}
+
+// Returns TRUE if this build's libyara has the module, by compiling an import of it
+static BOOL ModuleAvailable(__in LPCSTR name)
+{
+	BOOL available = FALSE;
+	YR_COMPILER *compiler = NULL;
+	if (yr_compiler_create(&compiler) == ERROR_SUCCESS)
+	{
+		qstring text;
+		text.sprnt("import \"%s\"\n", name);
+		available = (yr_compiler_add_string(compiler, text.c_str(), NULL) == 0);
+		yr_compiler_destroy(compiler);
+	}
+	return available;
+}
+
+BOOL LoadRuleImage(__in LPCSTR path, __out YR_RULES **rules, __out RULE_SOURCES &sources, HASH_RULE_FILE hashFile)
+{
+	*rules = NULL;
+	sources.clear();
+	BOOL valid = FALSE;
+	FILE *fp = NULL;
+	LPCSTR name = PathFindFileNameA(path);
+
+	try
+	{
+		qwstring imagePath;
+		GetImagePath(path, imagePath);
+		if (_wfopen_s(&fp, imagePath.c_str(), L"rbS") != 0)
+			return FALSE;
+
+		// Header
+		UINT32 signature = 0, version = 0, arenaVersion = 0, moduleCount = 0;
+		UINT64 hash = 0, current = 0;
+		if ((fread(&signature, sizeof(signature), 1, fp) != 1) || (signature != RULE_IMAGE_SIGNATURE) ||
+			(fread(&version, sizeof(version), 1, fp) != 1) || (version != RULE_IMAGE_VERSION) ||
+			(fread(&arenaVersion, sizeof(arenaVersion), 1, fp) != 1) ||
+			(fread(&hash, sizeof(hash), 1, fp) != 1) ||
+			(fread(&moduleCount, sizeof(moduleCount), 1, fp) != 1))
+		{
+			RuleMsg(MSG_TAG "* \"%s\" rule image is bad or an unknown version, compiling the rules file *\n", name);
+			goto exit;
+		}
+		if (arenaVersion != YR_ARENA_FILE_VERSION)
+		{
+			if (optionVerbose)
+				RuleMsg("\"%s\" rule image is for libyara arena version %u, not %u, compiling the rules file\n", name, arenaVersion, YR_ARENA_FILE_VERSION);
+			goto exit;
+		}
+
+		for (UINT32 i = 0; i < moduleCount; i++)
+		{
+			UINT32 length = 0;
+			char module[128];
+			if ((fread(&length, sizeof(length), 1, fp) != 1) || (length == 0) || (length >= sizeof(module)) || (fread(module, length, 1, fp) != 1))
+				goto exit;
+			module[length] = 0;
+			if (!ModuleAvailable(module))
+			{
+				if (optionVerbose)
+					RuleMsg("\"%s\" rule image imports module \"%s\" not in this build, compiling the rules file\n", name, module);
+				goto exit;
+			}
+		}
+
+		// Never for an edited rules file
+		if (!hashFile(path, current) || (current != hash))
+		{
+			if (optionVerbose)
+				RuleMsg("\"%s\" rules file changed since its rule image was built, compiling it\n", name);
+			goto exit;
+		}
+
+		YR_STREAM stream = { fp, StreamRead, NULL };
+		int yaraResult = yr_rules_load_stream(&stream, rules);
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			RuleMsg(MSG_TAG "* \"%s\" rule image load failed with: %s, compiling the rules file *\n", name, YaraStatusString(yaraResult));
+			*rules = NULL;
+			goto exit;
+		}
+
+		AddRuleSource(sources, path, hash);
+		valid = TRUE;
+	}
+	CATCH()
+
+	exit:;
+	if (fp)
+		fclose(fp);
+	if (!valid && *rules)
+	{
+		yr_rules_destroy(*rules);
+		*rules = NULL;
+	}
+	return valid;
+}
+
+BOOL SaveRuleImage(__in LPCSTR path, UINT64 hash, __in YR_RULES *rules)
+{
+	BOOL success = FALSE;
+	FILE *fp = NULL;
+	qwstring imagePath, tempPath;
+
+	try
+	{
+		GetImagePath(path, imagePath);
+		tempPath = imagePath;
+		tempPath += L".tmp";
+		if (_wfopen_s(&fp, tempPath.c_str(), L"wbS") != 0)
+		{
+			msg(MSG_TAG "** Failed to create the rule image for \"%s\" **\n", path);
+			return FALSE;
+		}
+
+		qstrvec_t modules;
+		GetImports(path, modules);
+		qvector<LPCSTR> names;
+		for (const qstring &module : modules)
+			names.push_back(module.c_str());
+		WriteRuleImageHeader(fp, hash, names.begin(), (UINT32) names.size());
+
+		YR_STREAM stream = { fp, NULL, StreamWrite };
+		int yaraResult = yr_rules_save_stream(rules, &stream);
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			msg(MSG_TAG "** Rule image save failed with: %s **\n", YaraStatusString(yaraResult));
+			goto exit;
+		}
+
+		success = (ferror(fp) == 0);
+		fclose(fp);
+		fp = NULL;
+		if (success)
+			success = MoveFileExW(tempPath.c_str(), imagePath.c_str(), MOVEFILE_REPLACE_EXISTING);
+	}
+	CATCH()
+
+	exit:;
+	if (fp)
+		fclose(fp);
+	if (!success && !tempPath.empty())
+		DeleteFileW(tempPath.c_str());
+	return success;
+}
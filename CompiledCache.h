@@ -0,0 +1,62 @@
+
+// Compiled rules disk cache
+#pragma once
+
+#include "stdafx.h"
+#include "RuleImage.h"
+
+/*
+Compiling a large rule set (like the ~2.4MB signsrch one) is most of the startup time of a scan, so the compiled
+rules are saved with yr_rules_save_stream() and loaded back with yr_rules_load_stream() when nothing they were
+built from has changed.
+Cache file: "<IDA user folder>\yara4ida_cache\<root rules path and namespace hash>.yarc"
+ Header: signature, version, build key, source count, then per source file: UTF-8 path, content hash.
+ The rest is the libyara rules arena stream.
+The build key covers the libyara arena format version (YR_ARENA_FILE_VERSION), the libyara version, and this plugin
+module's build; libyara and its modules are linked into the plugin, so a rebuild is what changes the module set.
+It also covers the namespace the rules were compiled into, as that's part of the compiled rules, and the compiler
+settings ("options", like the atom quality table hash) that change what gets compiled.
+The sources are the root rules file first, then every include file as resolved by the compiler include callback.
+On load each source is hashed from its current contents by the caller's hash function (the rule loader's goes through
+its include cache, so files unchanged by size and last write time aren't read again); any difference, a missing file,
+or a bad cache file is a miss, and the cache file is deleted so the next compile rewrites it.
+
+Rule images are the same thing placed next to the rules file, "<rules file name>.yarc", so even the first run after
+an install or a plugin update can skip the compile. They're for self contained rules files (no includes), like the
+signsrch sets. The plugin build makes the signsrch ones with the RuleImageBuilder tool, and the "Build rule images"
+command makes them for whatever is in the plugin rules folder. The rules are compiled into the fixed
+RULE_IMAGE_NAMESPACE namespace; the file format is in RuleImage.h.
+Since an image has to outlive plugin rebuilds, it isn't tied to the build; it's used when the arena format matches,
+every module it imports is in this build's libyara, and the rules file hasn't changed, else the rules file is
+compiled as usual. It's never rewritten at run time.
+*/
+
+// A file a rule set was compiled from
+struct RULE_SOURCE
+{
+	qstring path;	// Full UTF-8 path
+	UINT64 hash;	// Content hash
+};
+typedef qvector<RULE_SOURCE> RULE_SOURCES;
+
+// Content hash of a rules file
+BOOL HashRuleFile(__in LPCSTR path, __out UINT64 &hash);
+typedef BOOL (*HASH_RULE_FILE)(__in LPCSTR path, __out UINT64 &hash);
+
+// Add a source to the list, ignoring repeats of the same file
+void AddRuleSource(__inout RULE_SOURCES &sources, __in LPCSTR path, UINT64 hash);
+
+// Load the cached compile of a root rules file, returns TRUE and the rules (and optionally their sources) on a valid cache hit
+// "options" is a hash of the non default compiler settings, 0 for none
+BOOL LoadCompiledRules(__in LPCSTR rootPath, __in LPCSTR ns, UINT64 options, __out YR_RULES **rules, __out_opt RULE_SOURCES *sources = NULL, HASH_RULE_FILE hashFile = HashRuleFile);
+
+// Cache a fresh compile; "sources" must start with the root rules file
+BOOL SaveCompiledRules(__in const RULE_SOURCES &sources, __in LPCSTR ns, UINT64 options, __in YR_RULES *rules);
+
+// Load the rule image of a rules file if it has a usable one. Returns TRUE with the rules, and the rules file as their
+// only source. The rules are in the RULE_IMAGE_NAMESPACE namespace; the namespace name shown and selected on is the
+// rule set's (see RULE_SETS), the same as for a compile.
+BOOL LoadRuleImage(__in LPCSTR path, __out YR_RULES **rules, __out RULE_SOURCES &sources, HASH_RULE_FILE hashFile = HashRuleFile);
+
+// Save the rule image of a rules file compiled from it alone, into RULE_IMAGE_NAMESPACE. Returns TRUE on success.
+BOOL SaveRuleImage(__in LPCSTR path, UINT64 hash, __in YR_RULES *rules);
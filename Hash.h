@@ -0,0 +1,26 @@
+
+// Shared content hash helpers
+#pragma once
+
+// 64bit FNV-1a
+#define FNV64_BASIS 0xCBF29CE484222325ull
+#define FNV64_PRIME 0x00000100000001B3ull
+
+static inline UINT64 fnv64(UINT64 hash, __in_bcount(size) LPCVOID data, size_t size)
+{
+	const BYTE *ptr = (const BYTE*) data;
+	while (size--)
+	{
+		hash ^= *ptr++;
+		hash *= FNV64_PRIME;
+	}
+	return hash;
+}
+
+static inline UINT64 fnv64(UINT64 hash, __in_opt LPCSTR str)
+{
+	// Include the terminator so adjacent strings can't run together
+	if (!str)
+		str = "";
+	return fnv64(hash, str, strlen(str) + 1);
+}
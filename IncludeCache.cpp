@@ -0,0 +1,128 @@
+
+// Rule include file cache
+#include "stdafx.h"
+#include "IncludeCache.h"
+#include "CompiledCache.h"
+
+BOOL IncludeCache::ReadMapped(__in LPCWSTR path, UINT64 size, __out std::vector<char> &text)
+{
+	BOOL success = FALSE;
+	HANDLE file = INVALID_HANDLE_VALUE, mapping = NULL;
+	LPCVOID view = NULL;
+	text.clear();
+
+	try
+	{
+		if (size >= MAXDWORD)
+			goto exit;
+		text.resize((size_t) size + 1);
+		text[(size_t) size] = 0;
+		if (size == 0)
+		{
+			// Can't map an empty file
+			success = TRUE;
+			goto exit;
+		}
+
+		file = CreateFileW(path, GENERIC_READ, (FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE), NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			goto exit;
+		mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!mapping)
+			goto exit;
+		view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (SIZE_T) size);
+		if (!view)
+			goto exit;
+
+		memcpy(text.data(), view, (size_t) size);
+		success = TRUE;
+	}
+	catch (...)
+	{
+		// Mapped view read errors (like the file shrinking under us) raise an in page SEH exception
+		success = FALSE;
+	}
+
+	exit:;
+	if (view)
+		UnmapViewOfFile(view);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	if (!success)
+		text.clear();
+	return success;
+}
+
+LPCSTR IncludeCache::Get(__in LPCSTR path, __out UINT64 &hash, __out_opt UINT64 *size)
+{
+	BOOL locked = FALSE;
+	try
+	{
+		qwstring widePath;
+		utf8_utf16(&widePath, path);
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		if (!GetFileAttributesExW(widePath.c_str(), GetFileExInfoStandard, &attributes))
+			return NULL;
+		UINT64 fileSize = (((UINT64) attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow);
+
+		qstring key(path);
+		key.make_lower();
+		AcquireSRWLockExclusive(&m_lock);
+		locked = TRUE;
+		LPCSTR text = NULL;
+		ENTRY &entry = m_entries[key];
+		if (!entry.text.empty() && (entry.size == fileSize) && (CompareFileTime(&entry.writeTime, &attributes.ftLastWriteTime) == 0))
+		{
+			m_hits++;
+			hash = entry.hash;
+			text = entry.text.data();
+		}
+		else
+		{
+			m_misses++;
+			if (!entry.text.empty())
+				m_retired.push_back(std::move(entry.text));
+			if (ReadMapped(widePath.c_str(), fileSize, entry.text))
+			{
+				entry.size = fileSize;
+				entry.writeTime = attributes.ftLastWriteTime;
+				entry.hash = HashRuleText(entry.text.data(), (size_t) fileSize);
+				hash = entry.hash;
+				text = entry.text.data();
+			}
+			else
+				m_entries.erase(key);
+		}
+		if (text && size)
+			*size = entry.size;
+		ReleaseSRWLockExclusive(&m_lock);
+		return text;
+	}
+	CATCH()
+	if (locked)
+		ReleaseSRWLockExclusive(&m_lock);
+	return NULL;
+}
+
+void IncludeCache::Clear()
+{
+	AcquireSRWLockExclusive(&m_lock);
+	m_entries.clear();
+	m_retired.clear();
+	ReleaseSRWLockExclusive(&m_lock);
+	ResetStats();
+}
+
+size_t IncludeCache::MemoryUsed()
+{
+	AcquireSRWLockShared(&m_lock);
+	size_t bytes = 0;
+	for (auto &it : m_entries)
+		bytes += (it.first.length() + it.second.text.capacity() + sizeof(ENTRY));
+	for (auto &text : m_retired)
+		bytes += text.capacity();
+	ReleaseSRWLockShared(&m_lock);
+	return bytes;
+}
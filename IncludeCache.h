@@ -0,0 +1,46 @@
+
+// Rule include file cache
+#pragma once
+
+#include "stdafx.h"
+
+/*
+Session cache of the rule files pulled in by "include" directives, keyed by full path and validated by the file's
+size and last write time, so a rule tree's includes are only read again when they change, and a file included
+more than once per compile is read once.
+Thread safe for the concurrent compiles. Text replaced by a changed file is retired rather than freed until Clear(), as
+another compile could still be parsing it.
+A miss reads the file through a memory mapped view into a NUL terminated copy (what the libyara include callback has
+to return) along with its content hash. The view isn't held open past the read; on Windows a live mapped view blocks
+editors from truncating and saving the file, which would get in the way of rule authoring.
+*/
+class IncludeCache
+{
+public:
+	IncludeCache() : m_hits(0), m_misses(0) { InitializeSRWLock(&m_lock); }
+
+	// Get a file's text and content hash, returns NULL if it can't be read. Valid until the file changes or Clear().
+	// Binary files work too, the optional size is the file size less the added terminator.
+	LPCSTR Get(__in LPCSTR path, __out UINT64 &hash, __out_opt UINT64 *size = NULL);
+	void Clear();
+
+	void ResetStats() { m_hits = m_misses = 0; }
+	UINT32 Hits() const { return m_hits; }
+	UINT32 Misses() const { return m_misses; }
+	size_t MemoryUsed();
+
+private:
+	struct ENTRY
+	{
+		UINT64 size;
+		FILETIME writeTime;
+		UINT64 hash;
+		std::vector<char> text;
+	};
+	std::map<qstring, ENTRY> m_entries; // By lower case path
+	std::vector<std::vector<char>> m_retired;
+	SRWLOCK m_lock;
+	UINT32 m_hits, m_misses;
+
+	static BOOL ReadMapped(__in LPCWSTR path, UINT64 size, __out std::vector<char> &text);
+};
@@ -2,6 +2,19 @@
 // Yara4Ida plugin main
 #include "stdafx.h"
 #include "MainDialog.h"
+#include "MatchExport.h"
+#include "ResultStore.h"
+#include "ResultDiff.h"
+#include "MatchIndex.h"
+#include "RuleCache.h"
+#include "MatchFilter.h"
+#include "RowCache.h"
+#include "RuleLoader.h"
+#include "RuleSelect.h"
+#include "AtomQuality.h"
+#include "RuleCost.h"
+#include <QtWidgets/QFileDialog>
+#include <QtCore/QDir>
 
 #ifndef _DEBUG
 #pragma comment(lib, "libyara/Release/libyara64.lib")
@@ -10,32 +23,120 @@
 #endif
 
 #define DEFAULT_RULES_FOLDER L"yara4ida_rules\\default.yar"
+#define DEFAULT_BE_RULES_FOLDER L"yara4ida_rules\\default_be.yar"
 #define DEFAULT_SHORTCUT "Alt-Y"
 #define COMMENT_TAG "#YARA: "
+#define ACTION_REOPEN "yara4ida:ReopenResults"
+#define REOPEN_SHORTCUT "Alt-Shift-Y"
+#define ACTION_DIFF "yara4ida:DiffResults"
+#define ACTION_NEXT_MATCH "yara4ida:NextRuleMatch"
+#define ACTION_PREV_MATCH "yara4ida:PrevRuleMatch"
+#define ACTION_ALL_MATCHES "yara4ida:AllRuleMatches"
+#define ACTION_SUMMARY "yara4ida:RuleSummary"
+#define ACTION_FILTER "yara4ida:FilterMatches"
+#define ACTION_RESUME_COMMENTS "yara4ida:ResumeComments"
+#define ACTION_REMOVE_COMMENTS "yara4ida:RemoveComments"
+#define ACTION_ROW_BENCHMARK "yara4ida:RowCacheBenchmark"
+#define ACTION_BUILD_ATOM_TABLE "yara4ida:BuildAtomTable"
+#define ACTION_ATOM_BENCHMARK "yara4ida:AtomTableBenchmark"
+#define ACTION_RULE_COST "yara4ida:RuleCostReport"
+#define ACTION_EXPORT_RULE_COST "yara4ida:ExportRuleCost"
+#define ACTION_BUILD_RULE_IMAGES "yara4ida:BuildRuleImages"
+#define ACTIONS_MENU "View/Open subviews/"
+#define NAVIGATE_MENU "Jump/"
+#define MATCH_CHOOSER_TITLE "{ YARA Matches }"
+#define SCAN_POLL_INTERVAL 250 // Background scan poll, in ms
+#define SUMMARY_CHOOSER_TITLE "{ YARA Matches by Rule }"
+#define RULE_COST_CHOOSER_TITLE "{ YARA Rule Cost }"
 
 static plugmod_t* idaapi init();
 static void idaapi term();
 static bool idaapi run(size_t);
+static void ReleaseScanData();
+static void InitResources();
+static void ReopenResults();
+static void NavigateRuleMatches(__in action_activation_ctx_t *ctx, int how);
+static void ShowRuleSummary();
+static void FilterMatches();
+static void StartCommentJob();
+static void PauseCommentJob();
+static void StopCommentJob();
+static void RemoveAllComments();
+static void LoadPluginOptions();
+static void BuildAtomTable();
+static void RunAtomBenchmark();
+static void ShowRuleCostReport();
+static void ExportRuleCost();
+static void BuildShippedRuleImages();
 extern BOOL ScanSegments(__out MATCHES& matches);
+extern BOOL StartScan();
+extern BOOL ScanDone();
+extern int GetScanProgress(__out qstring &text);
+extern void AbortScan();
+extern BOOL FinishScan(__out MATCHES &matches);
+static void AbortBackgroundScan();
 LPCSTR YaraStatusString(int error);
 
 BOOL optionPlaceComments = TRUE;
 BOOL optionSingleThread  = FALSE;
 BOOL optionVerbose = FALSE;
+BOOL optionExportMatches = FALSE;
+BOOL optionBackgroundScan = FALSE;
+BOOL optionSampleMatches = FALSE;
+BOOL optionRuleSummary = FALSE;	// Show the per rule summary instead of the flat match list
+UINT32 optionMatchCap = 0;			// Max stored matches per rule, 0 for no limit
+UINT32 optionHardLimit = 0;			// Disable rules that go over this many matches, 0 for no limit
+qstring optionRuleSelect;			// Rule selection expression, empty for all rules
+
+// Default rules byte order
+enum ENDIAN_MODE
+{
+	ENDIAN_AUTO,	// From the IDB processor
+	ENDIAN_LITTLE,
+	ENDIAN_BIG,
+	ENDIAN_MIXED	// Both, less the rules that are the same in each
+};
+ENDIAN_MODE optionEndian = ENDIAN_AUTO;
+qstring optionAtomTable;			// Atom quality table file, empty for the libyara heuristic
 //
-static WCHAR rulesPath[MAX_PATH] = { 0 };
-static char basePath[MAX_PATH] = { 0 };
-static char lastRulesFile[MAX_PATH] = { 0 };
+static qstrvec_t rulesFiles;		// Selected rules files, UTF-8
+static BOOL mixedDefaults = FALSE;	// rulesFiles are the little and big endian defaults together
+static qstring lastRulesFiles;		// The last scanned rules files, "; " separated
 static BOOL listChooserUp = FALSE;
 static BOOL initResourcesOnce = FALSE;
 static int chooserIcon = 0;
+static RULE_COSTS ruleCosts;		// Last rule cost report
+static qtimer_t scanTimer = NULL;		// Background scan poll timer, set while a background scan runs
+static TIMESTAMP scanStartTime = 0;
+static int scanReported = 0;			// Last logged background scan progress quarter
+static BOOL subsetScan = FALSE;			// The scan is with a subset of the loaded rules
+
+// Time sliced comment placement job
+static struct
+{
+	qtimer_t timer;		// Set while running
+	BOOL queued;		// Comments wanted for the current results
+	BOOL subset;		// Results of a rule selection subset scan, only add comments
+	size_t next;		// Next match store offset to comment, where a paused job resumes from
+	size_t heads, placed, unchanged, removed;
+	ea_t indexNext;		// Next comment index address to visit, walked in step with the matches
+	TIMESTAMP elapsed;	// Active placement time
+	int reported;		// Last logged progress quarter
+} commentJob;
+#define COMMENT_SLICE_MS 50 // Max comment placement time per UI tick
+#define COMMENT_TICK_MS 10	// Time between slices, for the UI to stay responsive
+#define MAX_PLACED_COMMENT (MAXSPECSIZE - 16) // Our comment part is kept in a netnode supval
 
 // YARA and other data that must be persistent while chooser control is up
-static int yaraInitalized = -1;
-static YR_COMPILER *s_compiler = NULL;
-YR_RULES *g_rules = NULL;
+RULE_SETS g_rules;
 static MATCHES matches;
-static std::map<segment_t*, qstring> seg2name;
+static SegmentTable segTable;
+static RULE_STRINGS_TABLE restoredRules; // Rule strings when showing results restored from the IDB
+static RuleMatchIndex ruleIndex;
+static RuleDisplayCache ruleCache; // Rule display strings, built with the match chooser
+static MatchFilterIndex filterIndex;
+static qstring lastFilter;
+static size_t navMatch = -1; // Match store offset of the last next/previous rule match step
 
 // ------------------------------------------------------------------------------------------------
 
@@ -53,36 +154,340 @@ __declspec(dllexport) plugin_t PLUGIN =
 	DEFAULT_SHORTCUT
 };
 
-static plugmod_t* idaapi init()
+// "Reopen last results" action
+struct ReopenActionHandler : public action_handler_t
 {
-	return PLUGIN_KEEP; // PLUGIN_OK
-}
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		ReopenResults();
+		return 0;
+	}
 
-// Normally doesn't hit as we need to stay resident for the modal windows
-static void idaapi term()
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return AST_ENABLE_ALWAYS; }
+};
+static ReopenActionHandler reopenActionHandler;
+
+// "Diff last two results" action
+struct DiffActionHandler : public action_handler_t
 {
-	try
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		InitResources();
+		ShowResultsDiff(chooserIcon);
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return AST_ENABLE_ALWAYS; }
+};
+static DiffActionHandler diffActionHandler;
+
+// Same rule match navigation actions
+enum NAVIGATE
+{
+	NAVIGATE_NEXT,
+	NAVIGATE_PREVIOUS,
+	NAVIGATE_ALL
+};
+struct NavigateActionHandler : public action_handler_t
+{
+	int how;
+	NavigateActionHandler(int _how) : how(_how) {}
+
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		NavigateRuleMatches(ctx, how);
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return (ruleIndex.Empty() ? AST_DISABLE : AST_ENABLE); }
+};
+static NavigateActionHandler nextActionHandler(NAVIGATE_NEXT), prevActionHandler(NAVIGATE_PREVIOUS), allActionHandler(NAVIGATE_ALL);
+
+// "Matches by rule" summary action
+struct SummaryActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		ShowRuleSummary();
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return (ruleIndex.Empty() ? AST_DISABLE : AST_ENABLE); }
+};
+static SummaryActionHandler summaryActionHandler;
+
+// "Filter matches" action
+struct FilterActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		FilterMatches();
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return (ruleIndex.Empty() ? AST_DISABLE : AST_ENABLE); }
+};
+static FilterActionHandler filterActionHandler;
+
+// "Pause/resume placing comments" action
+struct ResumeCommentsActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		if (commentJob.timer)
+			PauseCommentJob();
+		else
+			StartCommentJob();
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return ((commentJob.queued && (commentJob.next < matches.size())) ? AST_ENABLE : AST_DISABLE); }
+};
+static ResumeCommentsActionHandler resumeCommentsActionHandler;
+
+// "Remove all YARA comments" action
+struct RemoveCommentsActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		RemoveAllComments();
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return (!commentJob.timer ? AST_ENABLE : AST_DISABLE); }
+};
+static RemoveCommentsActionHandler removeCommentsActionHandler;
+
+// "Build atom quality table" action
+struct BuildAtomTableActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		BuildAtomTable();
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return AST_ENABLE_ALWAYS; }
+};
+static BuildAtomTableActionHandler buildAtomTableActionHandler;
+
+// "Atom quality table benchmark" action
+struct AtomBenchmarkActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		RunAtomBenchmark();
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return ((!optionAtomTable.empty() && !scanTimer) ? AST_ENABLE : AST_DISABLE); }
+};
+static AtomBenchmarkActionHandler atomBenchmarkActionHandler;
+
+// "Rule cost report" action
+struct RuleCostActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		ShowRuleCostReport();
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return (!scanTimer ? AST_ENABLE : AST_DISABLE); }
+};
+static RuleCostActionHandler ruleCostActionHandler;
+
+// "Export rule cost report" action
+struct ExportRuleCostActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		ExportRuleCost();
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return (!ruleCosts.empty() ? AST_ENABLE : AST_DISABLE); }
+};
+static ExportRuleCostActionHandler exportRuleCostActionHandler;
+
+// "Build rule images" action
+struct BuildRuleImagesActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
+	{
+		BuildShippedRuleImages();
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return (!scanTimer ? AST_ENABLE : AST_DISABLE); }
+};
+static BuildRuleImagesActionHandler buildRuleImagesActionHandler;
+
+#ifdef _DEBUG
+// Development "Row cache benchmark" action
+struct RowBenchmarkActionHandler : public action_handler_t
+{
+	virtual int idaapi activate(action_activation_ctx_t *ctx)
 	{
-		if (g_rules)
+		try
 		{
-			yr_rules_destroy(g_rules);
-			g_rules = NULL;
+			RowCacheBenchmark();
 		}
+		CATCH()
+		return 0;
+	}
+
+	virtual action_state_t idaapi update(action_update_ctx_t *ctx) { return AST_ENABLE_ALWAYS; }
+};
+static RowBenchmarkActionHandler rowBenchmarkActionHandler;
+#endif
+
+static const struct
+{
+	action_desc_t desc;
+	LPCSTR menu;
+	BOOL chooserPopup;
+} actions[] =
+{
+	{ ACTION_DESC_LITERAL(ACTION_REOPEN, "Yara4Ida: Reopen last results", &reopenActionHandler, REOPEN_SHORTCUT, "Show the YARA matches saved in this database without rescanning", -1), ACTIONS_MENU, FALSE },
+	{ ACTION_DESC_LITERAL(ACTION_DIFF, "Yara4Ida: Diff last two results", &diffActionHandler, NULL, "Show the matches added or removed since the previous scan", -1), ACTIONS_MENU, FALSE },
+	{ ACTION_DESC_LITERAL(ACTION_NEXT_MATCH, "Yara4Ida: Next match of this rule", &nextActionHandler, "Alt-Shift-N", "Jump to the next match of the selected or last visited YARA rule", -1), NAVIGATE_MENU, TRUE },
+	{ ACTION_DESC_LITERAL(ACTION_PREV_MATCH, "Yara4Ida: Previous match of this rule", &prevActionHandler, "Alt-Shift-P", "Jump to the previous match of the selected or last visited YARA rule", -1), NAVIGATE_MENU, TRUE },
+	{ ACTION_DESC_LITERAL(ACTION_ALL_MATCHES, "Yara4Ida: All matches of this rule", &allActionHandler, "Alt-Shift-A", "List all matches of the selected or last visited YARA rule", -1), NAVIGATE_MENU, TRUE },
+	{ ACTION_DESC_LITERAL(ACTION_SUMMARY, "Yara4Ida: Matches by rule", &summaryActionHandler, "Alt-Shift-R", "Show one row per matched YARA rule with its match count", -1), ACTIONS_MENU, TRUE },
+	{ ACTION_DESC_LITERAL(ACTION_FILTER, "Yara4Ida: Filter matches", &filterActionHandler, "Alt-Shift-F", "Show only the matches with the given tags, namespaces, or segments", -1), ACTIONS_MENU, TRUE },
+	{ ACTION_DESC_LITERAL(ACTION_RESUME_COMMENTS, "Yara4Ida: Pause/resume placing comments", &resumeCommentsActionHandler, NULL, "Pause the background match comment placement, or continue a paused one", -1), ACTIONS_MENU, TRUE },
+	{ ACTION_DESC_LITERAL(ACTION_REMOVE_COMMENTS, "Yara4Ida: Remove all YARA comments", &removeCommentsActionHandler, NULL, "Remove all of the match comments placed by Yara4Ida", -1), ACTIONS_MENU, FALSE },
+	{ ACTION_DESC_LITERAL(ACTION_BUILD_ATOM_TABLE, "Yara4Ida: Build atom quality table", &buildAtomTableActionHandler, NULL, "Build a YARA atom quality table from the byte frequencies of a folder of executables", -1), ACTIONS_MENU, FALSE },
+	{ ACTION_DESC_LITERAL(ACTION_ATOM_BENCHMARK, "Yara4Ida: Atom quality table benchmark", &atomBenchmarkActionHandler, NULL, "Compare the atom quality table against the libyara heuristic on this database", -1), ACTIONS_MENU, FALSE },
+	{ ACTION_DESC_LITERAL(ACTION_RULE_COST, "Yara4Ida: Rule cost report", &ruleCostActionHandler, NULL, "Rank the rules by their atom quality and compile warnings, costliest to scan first", -1), ACTIONS_MENU, FALSE },
+	{ ACTION_DESC_LITERAL(ACTION_EXPORT_RULE_COST, "Yara4Ida: Export rule cost report", &exportRuleCostActionHandler, NULL, "Save the last rule cost report as CSV or JSON Lines", -1), ACTIONS_MENU, FALSE },
+	{ ACTION_DESC_LITERAL(ACTION_BUILD_RULE_IMAGES, "Yara4Ida: Build rule images", &buildRuleImagesActionHandler, NULL, "Precompile the rules files in the plugin rules folder into rule images, loaded instead of compiling", -1), ACTIONS_MENU, FALSE },
+	#ifdef _DEBUG
+	{ ACTION_DESC_LITERAL(ACTION_ROW_BENCHMARK, "Yara4Ida: Row cache benchmark (debug)", &rowBenchmarkActionHandler, NULL, "Synthetic chooser display memory benchmark, up to 50M matches", -1), ACTIONS_MENU, FALSE },
+	#endif
+};
 
-		if (s_compiler)
+// Add our navigation actions to the match chooser's context menu, and the export to the rule cost chooser's
+struct UiEventListener : public event_listener_t
+{
+	virtual ssize_t idaapi on_event(ssize_t code, va_list va)
+	{
+		if (code == ui_populating_widget_popup)
 		{
-			yr_compiler_destroy(s_compiler);
-			s_compiler = NULL;
+			TWidget *widget = va_arg(va, TWidget*);
+			TPopupMenu *popup = va_arg(va, TPopupMenu*);
+			qstring title;
+			if ((get_widget_type(widget) == BWN_CHOOSER) && get_widget_title(&title, widget) && (title == MATCH_CHOOSER_TITLE))
+			{
+				for (auto &action : actions)
+				{
+					if (action.chooserPopup)
+						attach_action_to_popup(widget, popup, action.desc.name);
+				}
+			}
+			else
+			if ((get_widget_type(widget) == BWN_CHOOSER) && (title == RULE_COST_CHOOSER_TITLE))
+				attach_action_to_popup(widget, popup, ACTION_EXPORT_RULE_COST);
 		}
+		return 0;
+	}
+};
+static UiEventListener uiEventListener;
+
+// Default rules file path, relative to our plugin module
+static void GetDefaultRulesPath(__out_ecount(MAX_PATH) LPWSTR path, __in LPCWSTR file)
+{
+	HMODULE myModule = NULL;
+	GetModuleHandleExA((GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT | GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS), (LPCTSTR) &run, &myModule);
+	GetModuleFileNameExW(GetCurrentProcess(), myModule, path, (MAX_PATH - 1));
+	PathRemoveFileSpecW(path);
+	wcscat_s(path, MAX_PATH, L"\\");
+	wcscat_s(path, MAX_PATH, file);
+}
+
+// Get the default rules files for the IDB processor byte order, or as set by the "endian" option
+static void GetDefaultRules(__out qstrvec_t &paths, BOOL log)
+{
+	paths.clear();
+	BOOL bigEndian = inf_is_be();
+	ENDIAN_MODE mode = optionEndian;
+	if (mode == ENDIAN_AUTO)
+		mode = (bigEndian ? ENDIAN_BIG : ENDIAN_LITTLE);
+
+	WCHAR path[MAX_PATH] = { 0 };
+	if (mode != ENDIAN_BIG)
+	{
+		GetDefaultRulesPath(path, DEFAULT_RULES_FOLDER);
+		utf16_utf8(&paths.push_back(), path);
+	}
+	if (mode != ENDIAN_LITTLE)
+	{
+		GetDefaultRulesPath(path, DEFAULT_BE_RULES_FOLDER);
+		utf16_utf8(&paths.push_back(), path);
+	}
+	mixedDefaults = (mode == ENDIAN_MIXED);
 
-		if (yaraInitalized == ERROR_SUCCESS)
+	if (log)
+	{
+		qstring procName = inf_get_procname();
+		if (optionEndian == ENDIAN_AUTO)
+			msg("Processor \"%s\" is %s endian, using the %s endian default rules.\n", procName.c_str(), (bigEndian ? "big" : "little"), (bigEndian ? "big" : "little"));
+		else
 		{
-			yr_finalize();
-			yaraInitalized = -1;
+			static const LPCSTR modeNames[] = { "auto", "little", "big", "mixed" };
+			msg("Using the %s endian default rules from the \"endian\" option (processor \"%s\" is %s endian).\n", modeNames[mode], procName.c_str(), (bigEndian ? "big" : "little"));
 		}
+	}
+}
+
+static plugmod_t* idaapi init()
+{
+	for (auto &action : actions)
+	{
+		if (register_action(action.desc))
+			attach_action_to_menu(action.menu, action.desc.name, SETMENU_APP);
+	}
+	hook_event_listener(HT_UI, &uiEventListener);
+
+	// The command line options are only parsed here, once, as the default rules choice depends on them
+	LoadPluginOptions();
+
+	// Start compiling the default rules now so the first run can usually go straight to scanning
+	qstrvec_t defaultPaths;
+	GetDefaultRules(defaultPaths, FALSE);
+	PrecompileRules(defaultPaths);
+	return PLUGIN_KEEP; // PLUGIN_OK
+}
+
+// Normally doesn't hit as we need to stay resident for the modal windows
+static void idaapi term()
+{
+	AbortBackgroundScan();
+	unhook_event_listener(HT_UI, &uiEventListener);
+	for (auto &action : actions)
+	{
+		detach_action_from_menu(action.menu, action.desc.name);
+		unregister_action(action.desc.name);
+	}
+	ReleaseScanData();
+	g_rules.Clear();
+	ReleaseRules();
+}
 
+// Release the result data, on chooser close or plugin unload. The compiled rules stay resident (see "RuleLoader.h").
+static void ReleaseScanData()
+{
+	try
+	{
+		StopCommentJob();
 		matches.clear();
-		seg2name.clear();
+		segTable.Clear();
+		restoredRules.clear();
+		ruleIndex.Clear();
+		ruleCache.Clear();
+		filterIndex.Clear();
+		navMatch = -1;
 		listChooserUp = FALSE;
 
 		if (initResourcesOnce)
@@ -100,16 +505,835 @@ static void idaapi term()
 	CATCH()
 }
 
-// ------------------------------------------------------------------------------------------------
+// Load our Qt resources and the chooser icon
+static void InitResources()
+{
+	if (!initResourcesOnce)
+	{
+		initResourcesOnce = TRUE;
+		Q_INIT_RESOURCE(PlugInRes);
+
+		QFile file(STYLE_PATH "icon.png");
+		if (file.open(QFile::ReadOnly))
+		{
+			QByteArray ba = file.readAll();
+			chooserIcon = load_custom_icon(ba.constData(), ba.size(), "png");
+		}
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// Parse the optional IDA command line plugin options, at plugin load. For example:
+// -Oyara4ida:matchcap=5000:hardlimit=250000:sample:summary:select=tag=AND:atomtable=C:\tables\pe.bin
+static void LoadPluginOptions()
+{
+	LPCSTR options = get_plugin_options("yara4ida");
+	if (!options || !options[0])
+		return;
+
+	// Keep the drive letter colon of path values, "=C:\"
+	qstring tmp(options);
+	for (size_t i = 2; (i + 1) < tmp.length(); i++)
+	{
+		if ((tmp[i] == ':') && (tmp[i - 2] == '=') && isalpha((BYTE) tmp[i - 1]) && ((tmp[i + 1] == '\\') || (tmp[i + 1] == '/')))
+			tmp[i] = '\x01';
+	}
+
+	for (char *next = NULL, *token = qstrtok(tmp.begin(), ":", &next); token; token = qstrtok(NULL, ":", &next))
+	{
+		LPSTR value = strchr(token, '=');
+		if (value)
+		{
+			*value++ = 0;
+			if (LPSTR drive = strchr(value, '\x01'))
+				*drive = ':';
+		}
+
+		if (_stricmp(token, "matchcap") == 0 && value)
+			optionMatchCap = strtoul(value, NULL, 10);
+		else
+		if (_stricmp(token, "hardlimit") == 0 && value)
+			optionHardLimit = strtoul(value, NULL, 10);
+		else
+		if (_stricmp(token, "sample") == 0)
+			optionSampleMatches = (!value || (atoi(value) != 0));
+		else
+		if (_stricmp(token, "summary") == 0)
+			optionRuleSummary = (!value || (atoi(value) != 0));
+		else
+		if (_stricmp(token, "select") == 0)
+			optionRuleSelect = (value ? value : "");
+		else
+		if ((_stricmp(token, "endian") == 0) && value)
+		{
+			if (_stricmp(value, "auto") == 0)
+				optionEndian = ENDIAN_AUTO;
+			else
+			if ((_stricmp(value, "le") == 0) || (_stricmp(value, "little") == 0))
+				optionEndian = ENDIAN_LITTLE;
+			else
+			if ((_stricmp(value, "be") == 0) || (_stricmp(value, "big") == 0))
+				optionEndian = ENDIAN_BIG;
+			else
+			if (_stricmp(value, "mixed") == 0)
+				optionEndian = ENDIAN_MIXED;
+			else
+				msg(MSG_TAG "* Unknown \"endian\" option value: \"%s\", expected auto, le, be, or mixed *\n", value);
+		}
+		else
+		if ((_stricmp(token, "atomtable") == 0) && value)
+		{
+			// Relative to the plugin rules folder
+			if (PathIsRelativeA(value))
+			{
+				qwstring file(L"yara4ida_rules\\");
+				qwstring wideValue;
+				utf8_utf16(&wideValue, value);
+				file += wideValue;
+				WCHAR path[MAX_PATH] = { 0 };
+				GetDefaultRulesPath(path, file.c_str());
+				utf16_utf8(&optionAtomTable, path);
+			}
+			else
+				optionAtomTable = value;
+			SetAtomQualityTable(optionAtomTable.c_str());
+		}
+		else
+			msg(MSG_TAG "* Unknown plugin option: \"%s\" *\n", token);
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// Rule display strings, from the restored IDB rule table or the live rules
+static void BuildRuleCache()
+{
+	if (!restoredRules.empty())
+		ruleCache.Build(restoredRules);
+	else
+		ruleCache.Build(g_rules);
+}
+
+// Rules match IDA chooser/list view
+class MatchChooser : public chooser_multi_t
+{
+	enum COLUMNS
+	{
+		COL_ADDRESS,
+		COL_DESCRIPTION,
+		COL_TAGS,
+		COL_FILE,
+
+		COL_COUNT
+	};
+
+	static int _widths[COL_COUNT];
+	static const char *_header[COL_COUNT];
+	static const char _title[];
+
+	// Formatted rows for just the visible and nearby matches
+	mutable RowCache rows;
+
+public:
+	MatchChooser() : chooser_multi_t(CH_QFTYP_DEFAULT, _countof(_header), _widths, _header, _title),
+		rows(COL_COUNT, [this](size_t n, qstrvec_t &cols) { FormatRow(n, cols); })
+	{
+		// Setup hex address display to the minimal length plus a leading zero, after the segment names padded to the same width
+		// The store is address sorted, so the last match has the highest address
+		ea_t maxAddress = (!matches.empty() ? matches.back().address : 0);
+		char buffer[32];
+		size_t digits = strlen(_ui64toa((UINT64)maxAddress, buffer, 16));
+		if (++digits > 16) digits = 16;
+		sprintf_s(addressFormat, sizeof(addressFormat), "%%-%us:%%0%ullX", segTable.NameWidth(), (UINT32)digits);
+
+		if (ruleCache.Empty())
+			BuildRuleCache();
+		rows.Reset(matches.size());
+
+		// Custom chooser icon
+		icon = chooserIcon;
+	}
+
+	virtual void closed()
+	{
+		// Clean up
+		ReleaseScanData();
+	}
+
+	virtual const void* get_obj_id(size_t *len) const
+	{
+		*len = strlen(title);
+		return title;
+	}
+
+	virtual size_t get_count() const { return matches.size(); }
+
+	// On row clicked or enter pressed
+	virtual cbres_t enter(sizevec_t* sel)
+	{
+		size_t n = sel->front();
+		if (n < get_count())
+		{
+			navMatch = n;
+			jumpto(matches[n].address);
+		}
+		return NOTHING_CHANGED;
+	}
+
+	// Generate a row info
+	virtual void get_row(qstrvec_t *cols_, int *icon_, chooser_item_attrs_t *attributes, size_t n) const
+	{
+		try
+		{
+			rows.Get(n, *cols_);
+			*icon_ = -1;
+		}
+		CATCH()
+	}
+
+private:
+	char addressFormat[24];
+
+	// Row cache page fill
+	void FormatRow(size_t n, qstrvec_t &cols) const
+	{
+		const MATCH &m = matches[n];
+		cols[COL_ADDRESS].sprnt(addressFormat, segTable.Name(m.segment), (UINT64)m.address);
+		cols[COL_DESCRIPTION] = ruleCache.Description(m.rule);
+		cols[COL_TAGS] = ruleCache.Tags(m.rule);
+		cols[COL_FILE] = ruleCache.Namespace(m.rule);
+	}
+};
+
+const char MatchChooser::_title[] = { MATCH_CHOOSER_TITLE };
+const char* MatchChooser::_header[COL_COUNT] = { "Address",	"Description", "Tags", "File" };
+int MatchChooser::_widths[COL_COUNT] = { /*Address*/ 12, /*Description*/ 40, /*Tags*/ 8, /*File. Auto-extends to the end*/ 20 };
+
+// ------------------------------------------------------------------------------------------------
+
+// Rule name for live or restored results
+static LPCSTR RuleName(UINT32 rule)
+{
+	return ((rule < ruleCache.Count()) ? ruleCache.Name(rule) : "?????");
+}
+
+// A single rule's matches, rows read straight from the rule index
+class RuleMatchesChooser : public chooser_t
+{
+	enum COLUMNS
+	{
+		COL_ADDRESS,
+		COL_NUMBER,
+		COL_LENGTH,
+
+		COL_COUNT
+	};
+
+	static int _widths[COL_COUNT];
+	static const char *_header[COL_COUNT];
+
+	qstring titleStr;
+	UINT32 rule;
+
+public:
+	RuleMatchesChooser(UINT32 _rule) : chooser_t(CH_QFTYP_DEFAULT, _countof(_header), _widths, _header), rule(_rule)
+	{
+		titleStr.sprnt("{ YARA \"%s\" Matches }", RuleName(rule));
+		title = titleStr.c_str();
+		icon = chooserIcon;
+	}
+
+	virtual const void* get_obj_id(size_t *len) const
+	{
+		*len = strlen(title);
+		return title;
+	}
+
+	// Empty once the results are released
+	virtual size_t get_count() const { return ((rule < ruleIndex.RuleCount()) ? ruleIndex.Count(rule) : 0); }
+
+	virtual cbret_t enter(size_t n)
+	{
+		if (n < get_count())
+		{
+			navMatch = ruleIndex.Matches(rule)[n];
+			jumpto(matches[navMatch].address);
+		}
+		return cbret_t();
+	}
+
+	virtual void get_row(qstrvec_t *cols_, int *icon_, chooser_item_attrs_t *attributes, size_t n) const
+	{
+		try
+		{
+			qstrvec_t &cols = *cols_;
+			const MATCH &m = matches[ruleIndex.Matches(rule)[n]];
+
+			cols[COL_ADDRESS].sprnt("%s:%llX", segTable.Name(m.segment), (UINT64) m.address);
+			cols[COL_NUMBER].sprnt("%u", (UINT32) (n + 1));
+			cols[COL_LENGTH].sprnt("%u", m.length);
+			*icon_ = -1;
+		}
+		CATCH()
+	}
+};
+
+const char* RuleMatchesChooser::_header[COL_COUNT] = { "Address", "#", "Length" };
+int RuleMatchesChooser::_widths[COL_COUNT] = { /*Address*/ 16, /*#*/ 8, /*Length*/ 8 };
+
+// ------------------------------------------------------------------------------------------------
+
+// Matches grouped by rule, one row per matched rule.
+// Only the per rule totals are gathered up front; a rule's addresses are listed on demand from the match store.
+class RuleSummaryChooser : public chooser_t
+{
+	enum COLUMNS
+	{
+		COL_MATCHES,
+		COL_FIRST,
+		COL_SEGMENTS,
+		COL_DESCRIPTION,
+		COL_TAGS,
+		COL_FILE,
+
+		COL_COUNT
+	};
+
+	static int _widths[COL_COUNT];
+	static const char *_header[COL_COUNT];
+	static const char _title[];
+
+	struct ROW
+	{
+		UINT32 rule;
+		UINT32 segments; // Segments hit
+	};
+	qvector<ROW> rows;
+	BOOL primary; // Shown instead of the match chooser, so owns the scan data
+
+public:
+	RuleSummaryChooser(BOOL _primary) : chooser_t(CH_QFTYP_DEFAULT, _countof(_header), _widths, _header, _title), primary(_primary)
+	{
+		if (ruleCache.Empty())
+			BuildRuleCache();
+
+		// A rule's matches are address sorted, so its distinct segments are just the segment changes
+		for (UINT32 rule = 0; rule < ruleIndex.RuleCount(); rule++)
+		{
+			if (UINT32 count = ruleIndex.Count(rule))
+			{
+				const UINT32 *offsets = ruleIndex.Matches(rule);
+				UINT32 segments = 1;
+				for (UINT32 i = 1; i < count; i++)
+					segments += (matches[offsets[i]].segment != matches[offsets[i - 1]].segment);
+				rows.push_back({ rule, segments });
+			}
+		}
+
+		// Noisiest rules first
+		std::stable_sort(rows.begin(), rows.end(), [](const ROW &a, const ROW &b) { return ruleIndex.Count(a.rule) > ruleIndex.Count(b.rule); });
+		icon = chooserIcon;
+	}
+
+	virtual void closed()
+	{
+		if (primary)
+			ReleaseScanData();
+	}
+
+	virtual const void* get_obj_id(size_t *len) const
+	{
+		*len = strlen(title);
+		return title;
+	}
+
+	// Empty once the results are released
+	virtual size_t get_count() const { return (!ruleIndex.Empty() ? rows.size() : 0); }
+
+	// Expand the rule into its own match list
+	virtual cbret_t enter(size_t n)
+	{
+		if (n < get_count())
+		{
+			UINT32 rule = rows[n].rule;
+			navMatch = ruleIndex.Matches(rule)[0];
+			jumpto(matches[navMatch].address);
+			RuleMatchesChooser *chooser = new RuleMatchesChooser(rule);
+			if (chooser)
+				chooser->choose();
+		}
+		return cbret_t();
+	}
+
+	virtual void get_row(qstrvec_t *cols_, int *icon_, chooser_item_attrs_t *attributes, size_t n) const
+	{
+		try
+		{
+			qstrvec_t &cols = *cols_;
+			const ROW &row = rows[n];
+			const MATCH &first = matches[ruleIndex.Matches(row.rule)[0]];
+
+			char buffer[32];
+			cols[COL_MATCHES] = NumberCommaString(ruleIndex.Count(row.rule), buffer);
+			cols[COL_FIRST].sprnt("%s:%llX", segTable.Name(first.segment), (UINT64) first.address);
+			cols[COL_SEGMENTS].sprnt("%u", row.segments);
+			cols[COL_DESCRIPTION] = ruleCache.Description(row.rule);
+			cols[COL_TAGS] = ruleCache.Tags(row.rule);
+			cols[COL_FILE] = ruleCache.Namespace(row.rule);
+			*icon_ = -1;
+		}
+		CATCH()
+	}
+};
+
+const char RuleSummaryChooser::_title[] = { SUMMARY_CHOOSER_TITLE };
+const char* RuleSummaryChooser::_header[COL_COUNT] = { "Matches", "First", "Segments", "Description", "Tags", "File" };
+int RuleSummaryChooser::_widths[COL_COUNT] = { /*Matches*/ 10, /*First*/ 16, /*Segments*/ 8, /*Description*/ 40, /*Tags*/ 8, /*File*/ 20 };
+
+// Open the summary on top of the match chooser
+static void ShowRuleSummary()
+{
+	try
+	{
+		if (ruleIndex.Empty())
+			return;
+		RuleSummaryChooser *chooser = new RuleSummaryChooser(FALSE);
+		if (chooser)
+			chooser->choose();
+	}
+	CATCH()
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// The matches passing a tag, namespace, and segment filter
+class FilteredMatchChooser : public chooser_t
+{
+	enum COLUMNS
+	{
+		COL_ADDRESS,
+		COL_DESCRIPTION,
+		COL_TAGS,
+		COL_FILE,
+
+		COL_COUNT
+	};
+
+	static int _widths[COL_COUNT];
+	static const char *_header[COL_COUNT];
+
+	qstring titleStr;
+	qvector<UINT32> offsets; // Match store offsets
+
+public:
+	FilteredMatchChooser(__in LPCSTR expression, __inout qvector<UINT32> &_offsets) : chooser_t(CH_QFTYP_DEFAULT, _countof(_header), _widths, _header)
+	{
+		offsets.swap(_offsets);
+		titleStr.sprnt("{ YARA Matches: %s }", expression);
+		title = titleStr.c_str();
+		icon = chooserIcon;
+	}
+
+	virtual const void* get_obj_id(size_t *len) const
+	{
+		*len = strlen(title);
+		return title;
+	}
+
+	// Empty once the results are released
+	virtual size_t get_count() const { return (!ruleIndex.Empty() ? offsets.size() : 0); }
+
+	virtual cbret_t enter(size_t n)
+	{
+		if (n < get_count())
+		{
+			navMatch = offsets[n];
+			jumpto(matches[navMatch].address);
+		}
+		return cbret_t();
+	}
+
+	virtual void get_row(qstrvec_t *cols_, int *icon_, chooser_item_attrs_t *attributes, size_t n) const
+	{
+		try
+		{
+			qstrvec_t &cols = *cols_;
+			const MATCH &m = matches[offsets[n]];
+
+			cols[COL_ADDRESS].sprnt("%s:%llX", segTable.Name(m.segment), (UINT64) m.address);
+			cols[COL_DESCRIPTION] = ruleCache.Description(m.rule);
+			cols[COL_TAGS] = ruleCache.Tags(m.rule);
+			cols[COL_FILE] = ruleCache.Namespace(m.rule);
+			*icon_ = -1;
+		}
+		CATCH()
+	}
+};
+
+const char* FilteredMatchChooser::_header[COL_COUNT] = { "Address", "Description", "Tags", "File" };
+int FilteredMatchChooser::_widths[COL_COUNT] = { /*Address*/ 16, /*Description*/ 40, /*Tags*/ 8, /*File*/ 20 };
+
+// Ask for a filter expression and show the matches that pass it
+static void FilterMatches()
+{
+	try
+	{
+		if (ruleIndex.Empty())
+			return;
+
+		// Example: "tag:AND ns:default_be | seg:.rdata"
+		if (!ask_str(&lastFilter, HIST_SRCH, "Yara4Ida filter (tag:, ns:, seg: terms, '|' for OR)"))
+			return;
+
+		TIMESTAMP startTime = GetTimeStamp();
+		if (ruleCache.Empty())
+			BuildRuleCache();
+		if (filterIndex.Empty())
+			filterIndex.Init(matches, ruleCache, segTable);
+
+		qvector<UINT32> offsets;
+		qstring error;
+		if (!filterIndex.Filter(lastFilter.c_str(), offsets, error))
+		{
+			msg(MSG_TAG "* Filter: %s *\n", error.c_str());
+			return;
+		}
+
+		char numBuff[32];
+		msg(MSG_TAG "Filter \"%s\": %s matches in %s\n", lastFilter.c_str(), NumberCommaString(offsets.size(), numBuff), TimeString(GetTimeStamp() - startTime));
+		if (offsets.empty())
+			return;
+
+		FilteredMatchChooser *chooser = new FilteredMatchChooser(lastFilter.c_str(), offsets);
+		if (chooser)
+			chooser->choose();
+	}
+	CATCH()
+}
+
+// Show new or restored results in the flat match chooser, or in the rule summary chooser if that option is set
+static BOOL ShowResultsChooser()
+{
+	if (optionRuleSummary)
+	{
+		RuleSummaryChooser *chooser = new RuleSummaryChooser(TRUE);
+		return (chooser && (chooser->choose() == 0));
+	}
+	else
+	{
+		MatchChooser *chooser = new MatchChooser();
+		return (chooser && (chooser->choose() == 0));
+	}
+}
+
+// Step to the next/previous match of a rule, or list all of its matches
+static void NavigateRuleMatches(__in action_activation_ctx_t *ctx, int how)
+{
+	try
+	{
+		if (ruleIndex.Empty())
+			return;
+
+		// The current match: the selected main chooser row, the last stepped to match, else the first match at or after the cursor
+		size_t current = -1;
+		if ((ctx->widget_type == BWN_CHOOSER) && (ctx->widget_title == MATCH_CHOOSER_TITLE) && !ctx->chooser_selection.empty())
+			current = ctx->chooser_selection.front();
+		else
+		if (navMatch < matches.size())
+			current = navMatch;
+		else
+			current = FindMatch(matches, get_screen_ea());
+		if (current >= matches.size())
+		{
+			PlaySound((LPCSTR) SND_ALIAS_SYSTEMEXCLAMATION, NULL, (SND_ALIAS_ID | SND_ASYNC));
+			return;
+		}
+
+		UINT32 rule = matches[current].rule;
+		if (how == NAVIGATE_ALL)
+		{
+			RuleMatchesChooser *chooser = new RuleMatchesChooser(rule);
+			if (chooser)
+				chooser->choose(ruleIndex.Rank(current));
+			return;
+		}
+
+		size_t next = ((how == NAVIGATE_NEXT) ? ruleIndex.Next(current) : ruleIndex.Previous(current));
+		if (next == (size_t) -1)
+		{
+			msg(MSG_TAG "No %s match of \"%s\".\n", ((how == NAVIGATE_NEXT) ? "next" : "previous"), RuleName(rule));
+			PlaySound((LPCSTR) SND_ALIAS_SYSTEMEXCLAMATION, NULL, (SND_ALIAS_ID | SND_ASYNC));
+			return;
+		}
+
+		navMatch = next;
+		jumpto(matches[next].address);
+		msg(MSG_TAG "\"%s\" match %u of %u\n", RuleName(rule), (ruleIndex.Rank(next) + 1), ruleIndex.Count(rule));
+	}
+	CATCH()
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// Stream the final sorted matches out to a file, the format selected by the file extension
+static void ExportMatches(__in LPCSTR path)
+{
+	TIMESTAMP startTime = GetTimeStamp();
+	MatchExporter::FORMAT format = MatchExporter::FormatFromPath(path);
+	msg("Exporting matches (%s) to: \"%s\"\n", MatchExporter::FormatName(format), path);
+	REFRESH_UI();
+
+	// Has a large embedded write buffer, keep it off the stack
+	MatchExporter *exporter = new MatchExporter();
+	qwstring widePath;
+	utf8_utf16(&widePath, path);
+	UINT32 segmentCount = (UINT32) get_segm_qty();
+	if (!exporter->Open(widePath.c_str(), format, g_rules.Count(), segmentCount))
+	{
+		char buffer[1024];
+		msg(MSG_TAG "** Export file create failed! Reason: \"%s\" **\n", GetErrorString(HRESULT_FROM_WIN32(exporter->LastError()), buffer));
+		delete exporter;
+		return;
+	}
+
+	// The rule strings come from the display cache, built once per rule
+	if (ruleCache.Empty())
+		BuildRuleCache();
+
+	for (MATCH &m : matches)
+	{
+		EXPORT_RECORD record =
+		{
+			m.rule, ((m.segment < segmentCount) ? m.segment : segmentCount), (UINT64) m.address, m.length,
+			ruleCache.Name(m.rule), ruleCache.Namespace(m.rule),
+			ruleCache.Tags(m.rule), ruleCache.DescriptionMeta(m.rule), segTable.Name(m.segment)
+		};
+		if (!exporter->Write(record))
+			break;
+	}
+
+	char numBuff[32];
+	if (exporter->Close())
+		msg("Exported %s matches, %s, in %s\n", NumberCommaString(exporter->Count(), numBuff), byteSizeString(exporter->BytesWritten()), TimeString(GetTimeStamp() - startTime));
+	else
+	{
+		char buffer[1024];
+		msg(MSG_TAG "** Export write failed! Reason: \"%s\" **\n", GetErrorString(HRESULT_FROM_WIN32(exporter->LastError()), buffer));
+	}
+	delete exporter;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+// Strip our part from an item's comment, and drop its comment index entry
+static void RemovePlacedComment(ea_t address)
+{
+	qstring placed, comment;
+	if (GetPlacedComment(address, placed) && (get_cmt(&comment, address, TRUE) > 0))
+	{
+		// Left alone if the user edited our part
+		size_t pos = comment.find(placed);
+		if (pos != qstring::npos)
+		{
+			// Along with the separator we put before it
+			size_t len = placed.length();
+			if ((pos > 0) && ((comment[pos - 1] == ' ') || (comment[pos - 1] == '\n')))
+				pos--, len++;
+			comment.remove(pos, len);
+			set_cmt(address, comment.c_str(), TRUE);
+		}
+	}
+	DelPlacedComment(address);
+}
+
+// Remove our comments from the indexed items before "address" that no longer have matches.
+// Not after a rule subset scan, where they can be from the rules that weren't scanned.
+static void RemoveStaleComments(ea_t address)
+{
+	while ((commentJob.indexNext != BADADDR) && (commentJob.indexNext < address))
+	{
+		if (!commentJob.subset)
+		{
+			RemovePlacedComment(commentJob.indexNext);
+			commentJob.removed++;
+		}
+		commentJob.indexNext = NextPlacedComment(commentJob.indexNext);
+	}
+}
+
+// Comment the matched item starting at match store offset "i", returns the offset past its matches.
+// Matches are address sorted, and so are their item heads; each head's matches are one contiguous run. Every head gets
+// a single composed comment with its deduplicated rule descriptions and at most one get_cmt()/set_cmt() pair.
+// The comment index is walked in step, so unchanged items are skipped without fetching their comments.
+static size_t CommentItem(size_t i, __inout qvector<LPCSTR> &descriptions, __inout qstring &comment, __inout qstring &text)
+{
+	// Snap address to nearest item address, then gather the matches on the same item
+	ea_t address = get_item_head(matches[i].address);
+	ea_t end = get_item_end(address);
+	descriptions.clear();
+	for (size_t count = matches.size(); (i < count) && (matches[i].address < end); i++)
+	{
+		// Interned, so equal descriptions are the same pointer
+		LPCSTR description = ruleCache.Description(matches[i].rule);
+		if (!descriptions.has(description))
+			descriptions.push_back(description);
+	}
+	commentJob.heads++;
+
+	// Our part of the comment, sized to fit a netnode supval
+	text = COMMENT_TAG;
+	for (size_t j = 0; j < descriptions.size(); j++)
+	{
+		if ((text.length() + strlen(descriptions[j]) + 8) > MAX_PLACED_COMMENT)
+		{
+			text.append("...");
+			break;
+		}
+		text.cat_sprnt((j ? ", \"%s\"" : "\"%s\""), descriptions[j]);
+	}
+	text.append(' ');
+
+	RemoveStaleComments(address);
+	qstring placed;
+	if ((commentJob.indexNext == address) && GetPlacedComment(address, placed))
+	{
+		commentJob.indexNext = NextPlacedComment(address);
+
+		// Unchanged since the last run? After a rule subset scan, our placed comment is kept as is too.
+		if ((placed == text) || commentJob.subset)
+		{
+			commentJob.unchanged++;
+			return i;
+		}
+
+		// Replace our old part, keeping any user text around it
+		get_cmt(&comment, address, TRUE);
+		size_t pos = comment.find(placed);
+		if (pos != qstring::npos)
+			comment.remove(pos, placed.length());
+		comment.trim2();
+	}
+	else
+	{
+		// Already has comment?
+		int size = (int) get_cmt(&comment, address, TRUE);
+		if (size > 0)
+		{
+			// Yes. Skip if it has an unindexed comment from us, placed by an older version
+			if ((size > sizeof(COMMENT_TAG)) && (comment.find(COMMENT_TAG) != qstring::npos))
+				return i;
+		}
+		else
+			comment.clear();
+	}
+
+	// If large string add a line break else use a space to separate them
+	if (!comment.empty())
+		comment.append((comment.length() >= 54) ? '\n' : ' ');
+	comment.append(text);
+	set_cmt(address, comment.c_str(), TRUE);
+	SetPlacedComment(address, text.c_str());
+	commentJob.placed++;
+	return i;
+}
+
+// Comment placement timer, does a time bounded slice of items per tick in the IDA thread.
+// No wait box, the chooser and the rest of IDA stay usable in between the slices.
+static int idaapi CommentJobTimer(void *ud)
+{
+	try
+	{
+		TIMESTAMP sliceStart = GetTimeStamp();
+		TIMESTAMP deadline = (sliceStart + (COMMENT_SLICE_MS / 1000.0));
+		size_t count = matches.size();
+		qvector<LPCSTR> descriptions;
+		qstring comment, text;
+
+		for (UINT32 n = 1; commentJob.next < count; n++)
+		{
+			commentJob.next = CommentItem(commentJob.next, descriptions, comment, text);
+			if (((n % 64) == 0) && (GetTimeStamp() >= deadline))
+				break;
+		}
+		commentJob.elapsed += (GetTimeStamp() - sliceStart);
+
+		char numBuff1[32], numBuff2[32];
+		if (commentJob.next < count)
+		{
+			// Log the progress every quarter
+			int quarter = (int) ((commentJob.next * 4) / count);
+			if (quarter > commentJob.reported)
+			{
+				commentJob.reported = quarter;
+				msg(MSG_TAG "Placing comments.. %s of %s matches\n", NumberCommaString(commentJob.next, numBuff1), NumberCommaString(count, numBuff2));
+			}
+			return COMMENT_TICK_MS;
+		}
+		else
+		{
+			// Our comments past the last match are stale too
+			RemoveStaleComments(BADADDR);
+
+			// One comment update per item instead of per match
+			char numBuff3[32];
+			msg(MSG_TAG "Placed %s comments on %s items for %s matches in %s.\n", NumberCommaString(commentJob.placed, numBuff1), NumberCommaString(commentJob.heads, numBuff3), NumberCommaString(count, numBuff2), TimeString(commentJob.elapsed));
+			if (commentJob.unchanged || commentJob.removed)
+				msg("%s unchanged, %s stale comments removed.\n", NumberCommaString(commentJob.unchanged, numBuff1), NumberCommaString(commentJob.removed, numBuff2));
+		}
+	}
+	CATCH()
+
+	// Done, the -1 return unregisters us
+	commentJob.timer = NULL;
+	refresh_idaview_anyway();
+	return -1;
+}
+
+// Start or resume the queued comment placement. The results chooser is already up and the comments fill in behind it.
+static void StartCommentJob()
+{
+	if (!commentJob.queued || commentJob.timer || (commentJob.next >= matches.size()))
+		return;
 
-// Rules match IDA chooser/list view
-class MatchChooser : public chooser_multi_t
+	if (ruleCache.Empty())
+		BuildRuleCache();
+	commentJob.timer = register_timer(1, CommentJobTimer, NULL);
+	if (commentJob.timer)
+	{
+		char numBuff[32];
+		msg(MSG_TAG "Placing comments for %s matches in the background. \"Yara4Ida: Pause/resume placing comments\" pauses it.\n", NumberCommaString(matches.size() - commentJob.next, numBuff));
+	}
+	else
+		msg(MSG_TAG "** Failed to start the comment placement timer **\n");
+}
+
+// Pause a running comment placement, StartCommentJob() continues it
+static void PauseCommentJob()
+{
+	if (commentJob.timer)
+	{
+		unregister_timer(commentJob.timer);
+		commentJob.timer = NULL;
+		refresh_idaview_anyway();
+
+		char numBuff1[32], numBuff2[32];
+		msg(MSG_TAG "Comment placement paused at %s of %s matches.\n", NumberCommaString(commentJob.next, numBuff1), NumberCommaString(matches.size(), numBuff2));
+	}
+}
+
+// The last rule cost report, costliest rules first
+class RuleCostChooser : public chooser_t
 {
 	enum COLUMNS
 	{
-		COL_ADDRESS,
-		COL_DESCRIPTION,
-		COL_TAGS,
+		COL_RULE,
+		COL_QUALITY,
+		COL_ATOM,
+		COL_ATOMS,
+		COL_NO_ATOM,
+		COL_STRINGS,
+		COL_WARNINGS,
 		COL_FILE,
 
 		COL_COUNT
@@ -120,259 +1344,344 @@ class MatchChooser : public chooser_multi_t
 	static const char _title[];
 
 public:
-	MatchChooser() : chooser_multi_t(CH_QFTYP_DEFAULT, _countof(_header), _widths, _header, _title)
+	RuleCostChooser() : chooser_t(CH_QFTYP_DEFAULT, _countof(_header), _widths, _header, _title)
 	{
-		seg2name.clear();
-
-		// Setup hex address display to the minimal length plus a leading zero
-		ea_t maxAddress = 0;
-		size_t maxSegStr = 0;
-
-		for (MATCH& m : matches)
-		{
-			if (m.address > maxAddress)
-				maxAddress = m.address;
-
-			if (segment_t* seg = getseg(m.address))
-			{
-				qstring name;
-				get_segm_name(&name, seg);
-				seg2name.try_emplace(seg, name);
-
-				if (name.size() > maxSegStr)
-					maxSegStr = name.size();
-			}
-		}
-
-		char buffer[32];
-		size_t digits = strlen(_ui64toa((UINT64)maxAddress, buffer, 16));
-		if (++digits > 16) digits = 16;
-		sprintf_s(addressFormat, sizeof(addressFormat), "%%s:%%0%ullX", (UINT32)digits);
-
-		// Custom chooser icon
 		icon = chooserIcon;
 	}
 
-	virtual void closed()
-	{
-		// Clean up
-		term();
-	}
-
 	virtual const void* get_obj_id(size_t *len) const
 	{
 		*len = strlen(title);
 		return title;
 	}
 
-	virtual size_t get_count() const { return matches.size(); }
+	virtual size_t get_count() const { return ruleCosts.size(); }
 
-	// On row clicked or enter pressed
-	virtual cbres_t enter(sizevec_t* sel)
+	// Log the rule's compile warnings
+	virtual cbret_t enter(size_t n)
 	{
-		size_t n = sel->front();
 		if (n < get_count())
-			jumpto(matches[n].address);
-		return NOTHING_CHANGED;
+		{
+			const RULE_COST &cost = ruleCosts[n];
+			msg("%s (\"%s\"):\n", cost.rule.c_str(), cost.ns.c_str());
+			if (cost.warnings.empty())
+				msg(" No compile warnings.\n");
+			for (const qstring &warning : cost.warnings)
+				msg(" Line %s\n", warning.c_str());
+		}
+		return cbret_t();
 	}
 
-	// Generate a row info
 	virtual void get_row(qstrvec_t *cols_, int *icon_, chooser_item_attrs_t *attributes, size_t n) const
 	{
 		try
 		{
 			qstrvec_t &cols = *cols_;
-			MATCH &m = matches[n];
-
-			LPCSTR name;
-			segment_t *seg = getseg(m.address);
-			if (seg && (seg2name.find(seg) != seg2name.end()))
-				name = seg2name[seg].c_str();
+			const RULE_COST &cost = ruleCosts[n];
+			cols[COL_RULE] = cost.rule;
+			if (cost.minQuality != INT_MAX)
+				cols[COL_QUALITY].sprnt("%d", cost.minQuality);
 			else
-				name = "?????";
-
-			cols[COL_ADDRESS].sprnt(addressFormat, name, (UINT64)m.address);
-
-			// Get description string if rule has one
-			BOOL gotDescription = FALSE;
-			YR_META *meta;
-			yr_rule_metas_foreach(m.rule, meta)
-			{
-				if ((meta->type == META_TYPE_STRING) && (meta->identifier))
-				{
-					if (strcmp(meta->identifier, "description") == 0)
-					{
-						if (meta->string)
-						{
-							cols[COL_DESCRIPTION] = meta->string;
-							gotDescription = TRUE;
-						}
-						break;
-					}
-				}
-			}
-
-			// Use rule name if there's no description
-			if (!gotDescription)
-				cols[COL_DESCRIPTION] = ((m.rule->identifier != NULL) ? m.rule->identifier : "?????");
-
-			qstring tags;
-			LPCSTR tag_name;
-			yr_rule_tags_foreach(m.rule, tag_name)
-			{
-				tags += tag_name;
-				tags += ' ';
-			}
-			cols[COL_TAGS] = tags;
-
-			cols[COL_FILE] = ((m.rule->ns && m.rule->ns->name) ? m.rule->ns->name : "?????");
+				cols[COL_QUALITY] = "-";
+			cost.WeakAtomString(cols[COL_ATOM]);
+			cols[COL_ATOMS].sprnt("%u", cost.atoms);
+			cols[COL_NO_ATOM].sprnt("%u", cost.noAtoms);
+			cols[COL_STRINGS].sprnt("%u", cost.strings);
+			cols[COL_WARNINGS].sprnt("%u", (UINT32) cost.warnings.size());
+			cols[COL_FILE] = PathFindFileNameA(cost.ns.c_str());
 			*icon_ = -1;
 		}
 		CATCH()
 	}
-
-private:
-	char addressFormat[16];
 };
 
-const char MatchChooser::_title[] = { "{ YARA Matches }" };
-const char* MatchChooser::_header[COL_COUNT] = { "Address",	"Description", "Tags", "File" };
-int MatchChooser::_widths[COL_COUNT] = { /*Address*/ 12, /*Description*/ 40, /*Tags*/ 8, /*File. Auto-extends to the end*/ 20 };
+const char RuleCostChooser::_title[] = { RULE_COST_CHOOSER_TITLE };
+const char* RuleCostChooser::_header[COL_COUNT] = { "Rule", "Min quality", "Weakest atom", "Atoms", "No atom", "Strings", "Warnings", "File" };
+int RuleCostChooser::_widths[COL_COUNT] = { /*Rule*/ 32, /*Min quality*/ 6, /*Weakest atom*/ 12, /*Atoms*/ 6, /*No atom*/ 6, /*Strings*/ 6, /*Warnings*/ 6, /*File*/ 20 };
 
-// ------------------------------------------------------------------------------------------------
+// Pick a corpus folder and the table file, then build the table from it
+static void BuildAtomTable()
+{
+	try
+	{
+		QString folder = QFileDialog::getExistingDirectory(QApplication::activeWindow(), "Yara4Ida: Select a corpus folder of executables");
+		if (folder.isEmpty())
+			return;
+		LPSTR path = ask_file(TRUE, "*.bin", "Yara4Ida: Save the atom quality table to");
+		if (!path)
+			return;
+		qstring tablePath(path);
+		if (BuildAtomQualityTable(QDir::toNativeSeparators(folder).toUtf8().constData(), tablePath.c_str()))
+			msg("Use it with the \"atomtable\" plugin option, example: -Oyara4ida:atomtable=%s\n", tablePath.c_str());
+	}
+	CATCH()
+}
+
+// Benchmark the "atomtable" option table against the libyara heuristic on the last used rules
+static void RunAtomBenchmark()
+{
+	try
+	{
+		qstrvec_t paths = rulesFiles;
+		if (paths.empty())
+			GetDefaultRules(paths, FALSE);
+		AtomQualityBenchmark(paths, optionAtomTable.c_str());
+	}
+	CATCH()
+}
 
-// YARA compile warnings and error callback
-static void YaraCompilerStatusCallback(int error_level, __in const char *file_name, int line_number, __in const YR_RULE *rule, __in const char *message, __in void *user_data)
+// Build the rule cost report for the last used rules and show it
+static void ShowRuleCostReport()
 {
 	try
 	{
-		switch (error_level)
+		qstrvec_t paths = rulesFiles;
+		if (paths.empty())
+			GetDefaultRules(paths, FALSE);
+
+		// Replace an open report
+		if (TWidget *widget = find_widget(RULE_COST_CHOOSER_TITLE))
+			close_widget(widget, 0);
+		if (BuildRuleCostReport(paths, optionAtomTable.c_str(), ruleCosts))
 		{
-			case YARA_ERROR_LEVEL_ERROR:
-			{
-				// On return from this error, the compiler will abort
-				msg("\n ** Rule compile ERROR: **\n");
-				*((LPBOOL) user_data) = TRUE;
-			}
-			break;
+			RuleCostChooser *chooser = new RuleCostChooser();
+			if (chooser)
+				chooser->choose();
+		}
+	}
+	CATCH()
+}
 
-			case YARA_ERROR_LEVEL_WARNING:
-			{
-				if (!optionVerbose)
-					return;
+static void ExportRuleCost()
+{
+	try
+	{
+		if (LPSTR path = ask_file(TRUE, "*.csv;*.jsonl", "Yara4Ida: Export the rule cost report to (.csv or .jsonl)"))
+		{
+			qstring exportPath(path);
+			ExportRuleCostReport(ruleCosts, exportPath.c_str());
+		}
+	}
+	CATCH()
+}
 
-				msg("\n Rule compile WARNING:\n");
-			}
-			break;
-		};
+// Precompile the plugin rules folder's rules files into rule images next to them.
+// The build makes the signsrch ones with RuleImageBuilder; this is for the other rules files, or after editing them.
+static void BuildShippedRuleImages()
+{
+	try
+	{
+		WCHAR path[MAX_PATH] = { 0 };
+		GetDefaultRulesPath(path, L"yara4ida_rules");
+		qstring folder;
+		utf16_utf8(&folder, path);
 
-		msg(" File: \"%s\", line: %d\n", file_name, line_number);
-		if (rule && rule->metas && rule->metas->identifier)
-			msg(" Desc: \"%s\"\n", rule->metas->identifier);
-		msg(" Reason: \"%s\"\n", message);
-		REFRESH_UI();
+		msg("\n" MSG_TAG "Building rule images in \"%s\":\n", folder.c_str());
+		WaitBox::show("Yara for IDA", "Building rule images..", "url(" STYLE_PATH "progress-style.qss)", STYLE_PATH "icon.png");
+		WaitBox::updateAndCancelCheck(-1);
+		TIMESTAMP startTime = GetTimeStamp();
+		UINT32 built = BuildRuleImages(folder.c_str());
+		msg(MSG_TAG "%u rule image(s) built in %s\n", built, TimeString(GetTimeStamp() - startTime));
 	}
-	catch (std::exception &ex)
+	CATCH()
+	WaitBox::hide();
+}
+
+// Remove all of the comments we placed, in one pass over the comment index
+static void RemoveAllComments()
+{
+	try
 	{
-		msg("** STD C++ exception!: What: \"%s\", Function: \"%s\" **\n", ex.what(), __FUNCTION__);
-		*((LPBOOL) user_data) = TRUE;
-	} 
-	catch (...)
+		size_t count = PlacedCommentCount();
+		if (count == 0)
+		{
+			msg(MSG_TAG "No placed YARA comments to remove.\n");
+			return;
+		}
+
+		char numBuff[32];
+		if (ask_yn(ASKBTN_NO, "HIDECANCEL\nRemove the %s YARA match comments placed by Yara4Ida?", NumberCommaString(count, numBuff)) != ASKBTN_YES)
+			return;
+
+		// Drop any paused comment placement too
+		TIMESTAMP startTime = GetTimeStamp();
+		commentJob.queued = FALSE;
+		for (ea_t address = NextPlacedComment(BADADDR); address != BADADDR; address = NextPlacedComment(address))
+			RemovePlacedComment(address);
+		refresh_idaview_anyway();
+		msg(MSG_TAG "Removed %s comments in %s\n", numBuff, TimeString(GetTimeStamp() - startTime));
+	}
+	CATCH()
+}
+
+// Stop and reset the comment placement job
+static void StopCommentJob()
+{
+	if (commentJob.timer)
 	{
-		msg("** C/C++ exception! Function: \"%s\" **\n", __FUNCTION__); 
-		*((LPBOOL) user_data) = TRUE;
+		unregister_timer(commentJob.timer);
+		char numBuff1[32], numBuff2[32];
+		msg(MSG_TAG "Comment placement stopped at %s of %s matches.\n", NumberCommaString(commentJob.next, numBuff1), NumberCommaString(matches.size(), numBuff2));
 	}
+	ZeroMemory(&commentJob, sizeof(commentJob));
 }
 
-// YARA compile include file callback
-static const char* YaraCompilerIncludesCallback(__in const char *include_name, __in const char *calling_rule_filename, __in const char *calling_rule_namespace, __in void *user_data)
+// Place the optional comments, export, save, and show the results of a completed scan
+// Returns TRUE if the results chooser is up
+static BOOL ShowScanResults(TIMESTAMP startTime)
 {
-	// Need this for two reasons: 
-	//  1) To resolve relative paths for "include" directive files.
-	//  2) Verbose log/msg output for showing the inclusion of "include" directive files.
 	BOOL success = FALSE;
-	FILE *fp = NULL;
-	LPSTR fileBuffer = NULL;
-
 	try
 	{
-		if (optionVerbose)
-			//msg(" Include: \"%s\", Calling rule: \"%s\", \"%s\"\n", include_name, calling_rule_filename, calling_rule_namespace);
-			msg(" Include: Path: \"%s\", Calling rule: \"%s\"\n", include_name, calling_rule_filename);
-
-		// Convert the usual relative to absolute path as needed
-		char fixedPath[MAX_PATH];
-		if (PathIsRelativeA(include_name))
+		if (!matches.empty())
 		{
-			// Combine with base path derived from the root input file
-			char combinedPath[MAX_PATH] = { 0 };
-			if (!PathCombineA(combinedPath, basePath, include_name))
+			// Comments are placed after the chooser is up, see StartCommentJob()
+			BuildRuleCache();
+			StopCommentJob();
+			commentJob.queued = optionPlaceComments;
+			commentJob.subset = subsetScan;
+			commentJob.indexNext = NextPlacedComment(BADADDR);
+
+			segTable.Build();
+
+			// Optionally stream the results out to a file
+			if (optionExportMatches)
 			{
-				msg("YaraCompilerIncludesCallback: ** Failed to combine paths! **\n");
-				return NULL;
+				if (LPSTR exportPath = ask_file(TRUE, "*.jsonl;*.csv;*.bin;*.y4im", "Yara4Ida: Export matches to (.jsonl, .csv, .bin, or .y4im)"))
+					ExportMatches(exportPath);
 			}
 
-			// Clean up combined path
-			GetFullPathNameA(combinedPath, sizeof(fixedPath), fixedPath, NULL);
-			include_name = fixedPath;
-		}
-
-		// Read the text file into a buffer and return it
-		qwstring includePath;
-		utf8_utf16(&includePath, include_name);
-		errno_t err = _wfopen_s(&fp, includePath.c_str(), L"rbS");
-		if (err != 0)
-			goto exit;
+			ruleIndex.Build(matches, g_rules.Count());
 
-		long fileSize = fsize(fp);
-		if (fileSize == -1)
-			goto exit;
+			// Save the results in the IDB for "Reopen last results"
+			size_t blobSize = 0;
+			if (SaveResults(matches, g_rules, lastRulesFiles.c_str(), &blobSize))
+			{
+				if (optionVerbose)
+					msg("Saved results to the IDB, %s.\n", byteSizeString(blobSize));
+			}
+			else
+				msg(MSG_TAG "* Failed to save the results to the IDB *\n");
 
-		fileBuffer = (LPSTR) _aligned_malloc((size_t)fileSize + 1, 32);
-		if (!fileBuffer)
-			goto exit;
+			// Show the match chooser
+			//if (iconID == -1)
+			//	iconID = load_custom_icon(iconData, sizeof(iconData), "png");
+			success = listChooserUp = ShowResultsChooser();
+			char numBuff[32];
+			msg(MSG_TAG "Found %s matches in %s\n", NumberCommaString(matches.size(), numBuff), TimeString(GetTimeStamp() - startTime));
+		}
+		else
+		{
+			msg("Done. No rule matches found.\n");
 
-		success = (fread(fileBuffer, (size_t)fileSize, 1, fp) == 1);
-		fileBuffer[fileSize] = 0;
+			// Every comment placed by an earlier run is stale now, unless only some of the rules were scanned
+			if (optionPlaceComments && !subsetScan)
+			{
+				StopCommentJob();
+				commentJob.indexNext = NextPlacedComment(BADADDR);
+				RemoveStaleComments(BADADDR);
+				if (commentJob.removed)
+				{
+					char numBuff[32];
+					msg("%s stale comments removed.\n", NumberCommaString(commentJob.removed, numBuff));
+				}
+				StopCommentJob();
+			}
+		}
 	}
 	CATCH()
+	return success;
+}
 
-	exit:;
-	if (fp)
-	{
-		fclose(fp);
-		fp = NULL;
-	}
-	if (success)
-		return fileBuffer;
-	else
+// Background scan poll timer, runs in the IDA thread
+static int idaapi BackgroundScanTimer(void *ud)
+{
+	try
 	{
-		_aligned_free(fileBuffer);
-		fileBuffer = NULL;
-		return NULL;
+		if (!ScanDone())
+		{
+			// Log the progress every quarter
+			qstring text;
+			int quarter = (GetScanProgress(text) / 25);
+			if (quarter > scanReported)
+			{
+				scanReported = quarter;
+				msg(MSG_TAG "Background %s\n", text.c_str());
+			}
+			return SCAN_POLL_INTERVAL;
+		}
+
+		// Done, finish up in the foreground. The timer unregisters itself on the -1 return.
+		scanTimer = NULL;
+		PlaySound((LPCSTR) SND_ALIAS_SYSTEMASTERISK, NULL, (SND_ALIAS_ID | SND_ASYNC));
+		msg("\n>> " MSG_TAG "Background scan done.\n");
+		WaitBox::show("Yara for IDA", "Processing results..", "url(" STYLE_PATH "progress-style.qss)", STYLE_PATH "icon.png");
+		WaitBox::updateAndCancelCheck(-1);
+		REFRESH_UI();
+
+		BOOL success = FALSE;
+		if (!FinishScan(matches))
+			success = ShowScanResults(scanStartTime);
+		if (!success)
+			msg("* Aborted *\n");
+		if (optionPlaceComments)
+			refresh_idaview_anyway();
+		WaitBox::hide();
+		REFRESH_UI();
+		StartCommentJob();
 	}
+	CATCH()
+	scanTimer = NULL;
+	return -1;
 }
-//
-static void YaraCompilerIncludesFree(__in const char *callback_result_ptr, __in void *user_data)
+
+// Stop a running background scan
+static void AbortBackgroundScan()
 {
-	_aligned_free((PVOID) callback_result_ptr);
+	if (scanTimer)
+	{
+		unregister_timer(scanTimer);
+		scanTimer = NULL;
+		AbortScan();
+		msg(MSG_TAG "* Background scan canceled *\n");
+	}
 }
 
-// ------------------------------------------------------------------------------------------------
-
-void AltFileBtnHandler()
+// From the dialog's alternate rules file or folder selection
+void AltRulesHandler(__in const qstrvec_t &paths)
 {
-	if (LPSTR sigPathUtf8 = ask_file(FALSE, "*.yar;*.yara;*.rules", "Yara4Ida: Select YARA rules file"))
+	if (paths.empty())
+		return;
+
+	// Skip repeats, they'd define the same rules twice
+	rulesFiles.clear();
+	mixedDefaults = FALSE;
+	for (const qstring &path : paths)
 	{
-		// From UTF-8 to WCHAR'ish
-		qwstring tmp;
-		utf8_utf16(&tmp, sigPathUtf8);
-		wcsncpy_s(rulesPath, MAX_PATH, tmp.c_str(), tmp.size());
+		BOOL repeat = FALSE;
+		for (const qstring &file : rulesFiles)
+		{
+			if (_stricmp(file.c_str(), path.c_str()) == 0)
+			{
+				repeat = TRUE;
+				break;
+			}
+		}
+		if (!repeat)
+			rulesFiles.push_back(path);
 	}
 }
 
 static bool idaapi run(size_t arg)
 {
+	// Offer to cancel a running background scan
+	if (scanTimer)
+	{
+		if (ask_yn(ASKBTN_NO, "HIDECANCEL\nA Yara4Ida scan is running in the background.\nCancel it?") == ASKBTN_YES)
+			AbortBackgroundScan();
+		return true;
+	}
+
 	// Don't run again while our chooser is already up
 	if (listChooserUp)
 	{
@@ -381,8 +1690,6 @@ static bool idaapi run(size_t arg)
 	}
 
 	BOOL success = FALSE;
-	BOOL compileError = FALSE;
-	FILE *fp = NULL;
 
 	try
 	{
@@ -397,32 +1704,17 @@ static bool idaapi run(size_t arg)
 			goto exit;
 		}
 		
-		// Get the default relative to the IDA plugin rules file path
-		HMODULE myModule = NULL;
-		GetModuleHandleExA((GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT | GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS), (LPCTSTR) &run, &myModule);
-		GetModuleFileNameExW(GetCurrentProcess(), myModule, rulesPath, SIZESTR(rulesPath));
-		PathRemoveFileSpecW(rulesPath);
-		wcscat(rulesPath, L"\\" DEFAULT_RULES_FOLDER);
-
 		// Configure platform specifics
 		plat.Configure();
 
-		if (!initResourcesOnce)
-		{
-			initResourcesOnce = TRUE;
-			Q_INIT_RESOURCE(PlugInRes);
+		// The default rules for the processor byte order, relative to the IDA plugin
+		GetDefaultRules(rulesFiles, TRUE);
 
-			QFile file(STYLE_PATH "icon.png");
-			if (file.open(QFile::ReadOnly))
-			{
-				QByteArray ba = file.readAll();
-				chooserIcon = load_custom_icon(ba.constData(), ba.size(), "png");
-			}
-		}
+		InitResources();
 			
 		// -------------------------------------------
 		// 1) Do main dialog		
-		if (doMainDialog(optionPlaceComments, optionSingleThread, optionVerbose))
+		if (doMainDialog(optionPlaceComments, optionSingleThread, optionVerbose, optionExportMatches, optionBackgroundScan, optionRuleSelect))
 		{
 			msg("- Canceled -\n\n");
 			success = TRUE;
@@ -430,84 +1722,85 @@ static bool idaapi run(size_t arg)
 		}
 
 		// -------------------------------------------
-		// 2) Initialize libyara and open the rules file
+		// 2) Wait box and rules file paths
 		WaitBox::show("Yara for IDA", "Scanning..", "url(" STYLE_PATH "progress-style.qss)", STYLE_PATH "icon.png");
 		WaitBox::updateAndCancelCheck(-1);
 		REFRESH_UI();
 
-		char numBuff[32];
 		TIMESTAMP startTime = GetTimeStamp();
-		yaraInitalized = yr_initialize();
-		if (yaraInitalized != ERROR_SUCCESS)
-		{
-			msg(MSG_TAG "** YARA yr_initialize() failed with: %s **\n", YaraStatusString(yaraInitalized));
-			goto exit;
-		}
-
-		// Create compiler object
-		int yaraResult = yr_compiler_create(&s_compiler);
-		if (yaraResult != ERROR_SUCCESS)
+		lastRulesFiles.clear();
+		for (const qstring &file : rulesFiles)
 		{
-			msg(MSG_TAG "** YARA yr_compiler_create() failed with: %s **\n", YaraStatusString(yaraResult));
-			goto exit;
+			if (!lastRulesFiles.empty())
+				lastRulesFiles += "; ";
+			lastRulesFiles += file;
+			msg("Loading rules from: \"%s\"\n", file.c_str());
 		}
-		yr_compiler_set_callback(s_compiler, YaraCompilerStatusCallback, &compileError);
-		yr_compiler_set_include_callback(s_compiler, YaraCompilerIncludesCallback, YaraCompilerIncludesFree, NULL);
-		//msg("yr_compiler_create time: %s\n", TimestampString(GetTimestamp() - startTime, buffer2));
-
-		// Open rules file
-		qstring utf8Path;
-		utf16_utf8(&utf8Path, rulesPath);
-		strncpy_s(lastRulesFile, sizeof(lastRulesFile), utf8Path.c_str(), SIZESTR(lastRulesFile));
-		strncpy_s(basePath, sizeof(basePath), utf8Path.c_str(), SIZESTR(basePath) - 1);
-		if (LPSTR filename = PathFindFileNameA(basePath))
-			*filename = 0;
-		msg("Loading rules from: \"%s\"\n", lastRulesFile);
 		REFRESH_UI();
-		errno_t err = _wfopen_s(&fp, rulesPath, L"rbS");
-		if (err != 0)
-		{
-			char buffer[1024];
-			strerror_s(buffer, sizeof(buffer), err);
-			msg(MSG_TAG "** Rules open failed with: \"%s\" **\n", buffer);
-			goto exit;
-		}
 
 		// -------------------------------------------
-		// 3) Compile rules from rules file by handle
-		yaraResult = yr_compiler_add_file(s_compiler, fp, utf8Path.c_str(), utf8Path.c_str());
-		if (compileError)
-		{
-			// If compile error, bail out here since the yaraResult usually doesn't match the error				
+		// 3) Get the compiled rule sets; the resident ones when unchanged, else from the compiled cache or a compile
+		if (!GetRules(rulesFiles, g_rules))
 			goto exit;
-		}
-		else
-		if (yaraResult != ERROR_SUCCESS)
+		if (g_rules.Count() == 0)
 		{
-			msg(MSG_TAG "** YARA yr_compiler_add_file() failed with: %s **\n", YaraStatusString(yaraResult));
+			msg("* No rules loaded, aborted *\n");
 			goto exit;
 		}
 
-		fclose(fp);
-		fp = NULL;
-
-		// Get a rule set ref from the compiler instance
-		yaraResult = yr_compiler_get_rules(s_compiler, &g_rules);
-		if (yaraResult != ERROR_SUCCESS)
-		{
-			msg(MSG_TAG "** YARA yr_compiler_get_rules() failed with: %s **\n", YaraStatusString(yaraResult));
-			goto exit;
-		}
-		msg("%s rules loaded in %s\n", NumberCommaString(g_rules->num_rules, numBuff), TimeString(GetTimeStamp() - startTime));
-		if (g_rules->num_rules == 0)
+		// Enable just the selected rules, if there's a selection
 		{
-			msg("* No rules loaded, aborted *\n");
-			goto exit;
+			UINT32 selected = 0;
+			qstring error;
+			subsetScan = FALSE;
+			if (!SelectRules(g_rules, optionRuleSelect.c_str(), selected, error))
+			{
+				msg(MSG_TAG "* Rule selection: %s, aborted *\n", error.c_str());
+				goto exit;
+			}
+			if (selected == 0)
+			{
+				msg(MSG_TAG "* No rules selected by \"%s\", aborted *\n", optionRuleSelect.c_str());
+				goto exit;
+			}
+			if (selected < g_rules.Count())
+			{
+				subsetScan = TRUE;
+				char numBuff1[32], numBuff2[32];
+				msg("Rule selection \"%s\": %s of %s rules\n", optionRuleSelect.c_str(), NumberCommaString(selected, numBuff1), NumberCommaString(g_rules.Count(), numBuff2));
+			}
+
+			// The byte order independent rules (byte tables, strings) are in both mixed endian defaults, only scan them once
+			if (mixedDefaults)
+			{
+				UINT32 duplicates = DisableDuplicateRules(g_rules);
+				char numBuff[32];
+				msg("Mixed endian rules: skipping %s big endian rules that are the same as their little endian ones\n", NumberCommaString(duplicates, numBuff));
+			}
 		}
 		REFRESH_UI();
 
 		// -------------------------------------------
 		// 4) Scan segments with compiled YARA rules			
+		restoredRules.clear();
+		if (optionBackgroundScan)
+		{
+			// Mirror the segments and start the workers here, then hand IDA back to the user while they scan
+			if (StartScan())
+				goto exit;
+			scanTimer = register_timer(SCAN_POLL_INTERVAL, BackgroundScanTimer, NULL);
+			if (!scanTimer)
+			{
+				msg(MSG_TAG "** Failed to start the background scan timer **\n");
+				AbortScan();
+				goto exit;
+			}
+			scanStartTime = startTime;
+			scanReported = 0;
+			msg(MSG_TAG "Scanning in the background, the results will be shown when ready.\n");
+			success = TRUE;
+			goto exit;
+		}
 		if (ScanSegments(matches))
 		{
 			// On user abort or failure
@@ -517,94 +1810,11 @@ static bool idaapi run(size_t arg)
 
 		// -------------------------------------------
 		// 5) Optionally place comments, and show a match result IDA chooser
-		if (!matches.empty())
-		{
-			if (optionPlaceComments)
-			{
-				for (MATCH &m : matches)
-				{
-					// Snap address to nearest item address
-					ea_t address = get_item_head(m.address);
-
-					// Already has comment?
-					qstring comment;
-					int size = (int) get_cmt(&comment, address, TRUE);
-					if (size > 0)
-					{
-						// Yes. Skip if already has a comment from us from a previous run
-						if ((size > sizeof(COMMENT_TAG)) && (comment.find(COMMENT_TAG) != qstring::npos))
-							size = -1;
-						if (size != -1)
-						{
-							// If large string add a line break else use a space to separate them
-							if (size >= 54)
-							{
-								comment.append('\n');
-								size += SIZESTR("\n");
-							}
-							else
-							{
-								comment.append(' ');
-								size += SIZESTR(" ");
-							}
-						}
-					}
-					else
-						size = 0;
-
-					if (size >= 0)
-					{
-						// Get description string if rule has one
-						LPCSTR description = NULL;
-						YR_META *meta;
-						yr_rule_metas_foreach(m.rule, meta)
-						{
-							if ((meta->type == META_TYPE_STRING) && (meta->identifier))
-							{
-								if (strcmp(meta->identifier, "description") == 0)
-								{
-									if (meta->string)
-										description = meta->string;
-									break;
-								}
-							}
-						}
-
-						// If no description use rule name
-						if (!description || !description[0])
-							description = ((m.rule->identifier != NULL) ? m.rule->identifier : "????");
-
-						char buffer[MAXSTR];
-						if (comment.empty())
-							_snprintf_s(buffer, sizeof(buffer), SIZESTR(buffer), COMMENT_TAG "\"%s\" ", description);
-						else
-							_snprintf_s(buffer, sizeof(buffer), SIZESTR(buffer), "%s" COMMENT_TAG "\"%s\" ", comment.c_str(), description);
-						set_cmt(address, buffer, TRUE);
-					}
-				}
-			}
-
-			// Show the match chooser
-			//if (iconID == -1)
-			//	iconID = load_custom_icon(iconData, sizeof(iconData), "png");
-			MatchChooser *chooser = new MatchChooser();
-			success = listChooserUp = (chooser && (chooser->choose() == 0));
-			msg(MSG_TAG "Found %s matches in %s\n", NumberCommaString(matches.size(), numBuff), TimeString(GetTimeStamp() - startTime));
-		}
-		else
-		{
-			msg("Done. No rule matches found.\n");
-			goto exit;
-		}
+		success = ShowScanResults(startTime);
 	}
 	CATCH()
 
 	exit:;
-	if (fp)
-	{
-		fclose(fp);
-		fp = NULL;
-	}
 	if (!success)
 	{
 		// Clean up YARA data on abort or failure
@@ -616,9 +1826,48 @@ static bool idaapi run(size_t arg)
 
 	WaitBox::hide();
 	REFRESH_UI();
+	StartCommentJob();
 	return TRUE;
 }
 
+// Show the last results saved in the IDB. No libyara initialization, rule compile, or scan needed.
+static void ReopenResults()
+{
+	// Only one chooser instance at the time, and not while the scan data is in use
+	if (listChooserUp || scanTimer)
+	{
+		PlaySound((LPCSTR) SND_ALIAS_SYSTEMEXCLAMATION, NULL, (SND_ALIAS_ID | SND_ASYNC));
+		return;
+	}
+
+	try
+	{
+		TIMESTAMP startTime = GetTimeStamp();
+		ReleaseScanData();
+
+		RESULTS_INFO info;
+		if (!LoadResults(matches, restoredRules, info))
+		{
+			msg(MSG_TAG "No saved results in this database, run a scan first.\n");
+			ReleaseScanData();
+			return;
+		}
+		InitResources();
+		segTable.Build();
+		segTable.AssignSegments(matches);
+		ruleIndex.Build(matches, (UINT32) restoredRules.size());
+
+		char numBuff[32], timeBuff[32];
+		qstrftime64(timeBuff, sizeof(timeBuff), "%Y-%m-%d %H:%M:%S", info.savedTime);
+		msg("\n>> " MSG_TAG "Restored %s matches from %s\n", NumberCommaString(info.matchCount, numBuff), timeBuff);
+		msg("Rules: \"%s\", hash: %016llX\n", info.rulesPath.c_str(), info.rulesHash);
+
+		listChooserUp = ShowResultsChooser();
+		msg("Restored in %s\n", TimeString(GetTimeStamp() - startTime));
+	}
+	CATCH()
+}
+
 // ------------------------------------------------------------------------------------------------
 
 // In the libyara source there's a "yr_debug_error_as_string()", but not exposed from the library
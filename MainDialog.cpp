@@ -4,10 +4,12 @@
 #include "MainDialog.h"
 
 #include <QtWidgets/QDialogButtonBox>
+#include <QtWidgets/QFileDialog>
+#include <QtCore/QDir>
 
-extern void AltFileBtnHandler();
+extern void AltRulesHandler(__in const qstrvec_t &paths);
 
-MainDialog::MainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL &optionVerbose) : QDialog(QApplication::activeWindow())
+MainDialog::MainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL &optionVerbose, BOOL &optionExportMatches, BOOL &optionBackgroundScan, qstring &ruleSelect) : QDialog(QApplication::activeWindow())
 {
     Ui::MainCIDialog::setupUi(this);
     setWindowFlags(windowFlags() & ~Qt::WindowContextHelpButtonHint);
@@ -18,7 +20,10 @@ MainDialog::MainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL
     INITSTATE(checkBox1, optionPlaceComments);
     INITSTATE(checkBox2, optionSingleThread);
     INITSTATE(checkBox3, optionVerbose);
+    INITSTATE(checkBox4, optionExportMatches);
+    INITSTATE(checkBox5, optionBackgroundScan);
     #undef INITSTATE
+    lineEdit1->setText(QString::fromUtf8(ruleSelect.c_str()));
 
     // Apply style sheet
     QFile file(STYLE_PATH "style.qss");
@@ -29,14 +34,35 @@ MainDialog::MainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL
 // On "LOAD ALT RULES" press
 void MainDialog::pressSelect()
 {
-    AltFileBtnHandler();
+    QStringList files = QFileDialog::getOpenFileNames(this, "Yara4Ida: Select YARA rules files", QString(), "YARA rules (*.yar *.yara *.rules);;All files (*.*)");
+    qstrvec_t paths;
+    for (const QString &file : files)
+        paths.push_back(QDir::toNativeSeparators(file).toUtf8().constData());
+    AltRulesHandler(paths);
+}
+
+// On "RULES FOLDER" press, all the rules files in the folder
+void MainDialog::pressSelectFolder()
+{
+    QString folder = QFileDialog::getExistingDirectory(this, "Yara4Ida: Select YARA rules folder");
+    if (folder.isEmpty())
+        return;
+
+    QDir dir(folder);
+    QStringList files = dir.entryList(QStringList() << "*.yar" << "*.yara", QDir::Files, QDir::Name);
+    qstrvec_t paths;
+    for (const QString &file : files)
+        paths.push_back(QDir::toNativeSeparators(dir.absoluteFilePath(file)).toUtf8().constData());
+    if (paths.empty())
+        msg(MSG_TAG "* No *.yar or *.yara files in \"%s\" *\n", QDir::toNativeSeparators(folder).toUtf8().constData());
+    AltRulesHandler(paths);
 }
 
 // Do main dialog, return TRUE if canceled
-BOOL doMainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL &optionVerbose)
+BOOL doMainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL &optionVerbose, BOOL &optionExportMatches, BOOL &optionBackgroundScan, qstring &ruleSelect)
 {
 	BOOL result = TRUE;
-    MainDialog *dlg = new MainDialog(optionPlaceComments, optionSingleThread, optionVerbose);
+    MainDialog *dlg = new MainDialog(optionPlaceComments, optionSingleThread, optionVerbose, optionExportMatches, optionBackgroundScan, ruleSelect);
 
     // Set Dialog title with version number
 	qstring version, tmp;
@@ -49,7 +75,10 @@ BOOL doMainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL &opt
         CHECKSTATE(checkBox1, optionPlaceComments);
         CHECKSTATE(checkBox2, optionSingleThread);
         CHECKSTATE(checkBox3, optionVerbose);
+        CHECKSTATE(checkBox4, optionExportMatches);
+        CHECKSTATE(checkBox5, optionBackgroundScan);
         #undef CHECKSTATE
+        ruleSelect = dlg->lineEdit1->text().trimmed().toUtf8().constData();
 		result = FALSE;
     }
 	delete dlg;
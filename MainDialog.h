@@ -11,11 +11,12 @@ class MainDialog : public QDialog, public Ui::MainCIDialog
 {
     Q_OBJECT
 public:
-    MainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL &optionVerbose);
+    MainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL &optionVerbose, BOOL &optionExportMatches, BOOL &optionBackgroundScan, qstring &ruleSelect);
 
 private slots:
 	void pressSelect();
+	void pressSelectFolder();
 };
 
 // Do main dialog, return TRUE if canceled
-BOOL doMainDialog(BOOL &optionPlaceStructs, BOOL &optionProcessStatic, BOOL &optionAudioOnDone);
+BOOL doMainDialog(BOOL &optionPlaceComments, BOOL &optionSingleThread, BOOL &optionVerbose, BOOL &optionExportMatches, BOOL &optionBackgroundScan, qstring &ruleSelect);
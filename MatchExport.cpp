@@ -0,0 +1,317 @@
+
+// Streaming match result exporters
+#include "MatchExport.h"
+#include <stdlib.h>
+#include <string.h>
+
+MatchExporter::MatchExporter() :
+	m_file(INVALID_HANDLE_VALUE), m_format(FORMAT_JSONL), m_failed(FALSE), m_lastError(ERROR_SUCCESS),
+	m_count(0), m_written(0), m_used(0),
+	m_ruleEmitted(NULL), m_segmentEmitted(NULL), m_ruleCount(0), m_segmentCount(0)
+{
+}
+
+MatchExporter::FORMAT MatchExporter::FormatFromPath(__in LPCSTR path)
+{
+	if (LPCSTR ext = strrchr(path, '.'))
+	{
+		if (_stricmp(ext, ".csv") == 0)
+			return FORMAT_CSV;
+		else
+		if ((_stricmp(ext, ".bin") == 0) || (_stricmp(ext, ".y4im") == 0))
+			return FORMAT_BINARY;
+	}
+	return FORMAT_JSONL;
+}
+
+LPCSTR MatchExporter::FormatName(FORMAT format)
+{
+	switch (format)
+	{
+		case FORMAT_CSV: return "CSV";
+		case FORMAT_BINARY: return "binary";
+		default: return "JSON Lines";
+	};
+}
+
+BOOL MatchExporter::Open(__in LPCWSTR path, FORMAT format, UINT32 ruleCount, UINT32 segmentCount)
+{
+	Close();
+	m_format = format;
+	m_failed = FALSE;
+	m_lastError = ERROR_SUCCESS;
+	m_count = m_written = 0;
+	m_used = 0;
+
+	// Sequential write hint lets the cache manager skip read ahead and trim pages behind us
+	m_file = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, (FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN), NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+	{
+		m_lastError = GetLastError();
+		return FALSE;
+	}
+
+	switch (m_format)
+	{
+		case FORMAT_CSV:
+		PutText("rule,namespace,tags,description,address,segment,length\r\n");
+		break;
+
+		case FORMAT_BINARY:
+		{
+			// One time allocation of the definition emitted flags
+			m_ruleCount = ruleCount;
+			m_segmentCount = segmentCount;
+			m_ruleEmitted = (PBYTE) calloc(((size_t) ruleCount + 1), 1);
+			m_segmentEmitted = (PBYTE) calloc(((size_t) segmentCount + 1), 1);
+			if (!m_ruleEmitted || !m_segmentEmitted)
+			{
+				m_lastError = ERROR_NOT_ENOUGH_MEMORY;
+				Close();
+				return FALSE;
+			}
+
+			UINT32 version = EXPORT_BINARY_VERSION;
+			PutRaw(EXPORT_BINARY_SIGNATURE, (sizeof(EXPORT_BINARY_SIGNATURE) - 1));
+			PutRaw(&version, sizeof(version));
+		}
+		break;
+	};
+
+	return !m_failed;
+}
+
+BOOL MatchExporter::Close()
+{
+	BOOL result = !m_failed;
+
+	if (m_file != INVALID_HANDLE_VALUE)
+	{
+		if (m_format == FORMAT_BINARY)
+		{
+			Put((char) EXPORT_REC_END);
+			PutRaw(&m_count, sizeof(m_count));
+		}
+
+		result = (Flush() && !m_failed);
+		CloseHandle(m_file);
+		m_file = INVALID_HANDLE_VALUE;
+	}
+
+	if (m_ruleEmitted)
+	{
+		free(m_ruleEmitted);
+		m_ruleEmitted = NULL;
+	}
+	if (m_segmentEmitted)
+	{
+		free(m_segmentEmitted);
+		m_segmentEmitted = NULL;
+	}
+	return result;
+}
+
+BOOL MatchExporter::Write(__in const EXPORT_RECORD &record)
+{
+	if ((m_file == INVALID_HANDLE_VALUE) || m_failed)
+		return FALSE;
+
+	switch (m_format)
+	{
+		case FORMAT_CSV: WriteCsv(record); break;
+		case FORMAT_BINARY: WriteBinary(record); break;
+		default: WriteJsonl(record); break;
+	};
+
+	m_count++;
+	return !m_failed;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+BOOL MatchExporter::Flush()
+{
+	if (m_used && !m_failed)
+	{
+		DWORD written = 0;
+		if (!WriteFile(m_file, m_buffer, (DWORD) m_used, &written, NULL) || (written != (DWORD) m_used))
+		{
+			m_lastError = GetLastError();
+			m_failed = TRUE;
+		}
+		else
+			m_written += written;
+	}
+	m_used = 0;
+	return !m_failed;
+}
+
+void MatchExporter::PutRaw(__in LPCVOID data, size_t size)
+{
+	const BYTE *src = (const BYTE*) data;
+	while (size)
+	{
+		if (m_used == BUFFER_SIZE)
+			Flush();
+		size_t chunk = min(size, (BUFFER_SIZE - m_used));
+		memcpy(&m_buffer[m_used], src, chunk);
+		m_used += chunk, src += chunk, size -= chunk;
+	}
+}
+
+void MatchExporter::PutText(__in LPCSTR text)
+{
+	PutRaw(text, strlen(text));
+}
+
+void MatchExporter::PutHex(UINT64 value)
+{
+	char buffer[24];
+	_ui64toa_s(value, buffer, sizeof(buffer), 16);
+	_strupr_s(buffer, sizeof(buffer));
+	PutText(buffer);
+}
+
+void MatchExporter::PutDecimal(UINT64 value)
+{
+	char buffer[24];
+	_ui64toa_s(value, buffer, sizeof(buffer), 10);
+	PutText(buffer);
+}
+
+void MatchExporter::PutJsonString(__in_opt LPCSTR text)
+{
+	static const char hex[] = "0123456789abcdef";
+	Put('"');
+	if (text)
+	{
+		for (const BYTE *p = (const BYTE*) text; *p; p++)
+		{
+			BYTE c = *p;
+			switch (c)
+			{
+				case '"':  PutRaw("\\\"", 2); break;
+				case '\\': PutRaw("\\\\", 2); break;
+				case '\n': PutRaw("\\n", 2); break;
+				case '\r': PutRaw("\\r", 2); break;
+				case '\t': PutRaw("\\t", 2); break;
+				default:
+				{
+					if (c < 0x20)
+					{
+						char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+						PutRaw(esc, sizeof(esc));
+					}
+					else
+						Put((char) c);
+				}
+				break;
+			};
+		}
+	}
+	Put('"');
+}
+
+void MatchExporter::PutCsvString(__in_opt LPCSTR text)
+{
+	// RFC 4180: Always quote, double up embedded quotes
+	Put('"');
+	if (text)
+	{
+		for (LPCSTR p = text; *p; p++)
+		{
+			if (*p == '"')
+				Put('"');
+			Put(*p);
+		}
+	}
+	Put('"');
+}
+
+void MatchExporter::PutBinString(__in_opt LPCSTR text)
+{
+	size_t len = (text ? strlen(text) : 0);
+	if (len > 0xFFFF)
+	{
+		// Don't split a UTF-8 sequence, back off past any continuation bytes
+		len = 0xFFFF;
+		while ((len > 0) && ((((BYTE) text[len]) & 0xC0) == 0x80))
+			len--;
+	}
+	UINT16 len16 = (UINT16) len;
+	PutRaw(&len16, sizeof(len16));
+	PutRaw(text, len);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void MatchExporter::WriteJsonl(__in const EXPORT_RECORD &r)
+{
+	PutText("{\"rule\":");
+	PutJsonString(r.rule);
+	PutText(",\"namespace\":");
+	PutJsonString(r.ns);
+	PutText(",\"tags\":");
+	PutJsonString(r.tags);
+	PutText(",\"description\":");
+	PutJsonString(r.description);
+	PutText(",\"address\":\"0x");
+	PutHex(r.address);
+	PutText("\",\"segment\":");
+	PutJsonString(r.segment);
+	PutText(",\"length\":");
+	PutDecimal(r.length);
+	PutText("}\n");
+}
+
+void MatchExporter::WriteCsv(__in const EXPORT_RECORD &r)
+{
+	PutCsvString(r.rule);
+	Put(',');
+	PutCsvString(r.ns);
+	Put(',');
+	PutCsvString(r.tags);
+	Put(',');
+	PutCsvString(r.description);
+	PutText(",0x");
+	PutHex(r.address);
+	Put(',');
+	PutCsvString(r.segment);
+	Put(',');
+	PutDecimal(r.length);
+	PutText("\r\n");
+}
+
+void MatchExporter::WriteBinary(__in const EXPORT_RECORD &r)
+{
+	// Emit rule and segment definitions on first reference
+	if ((r.ruleId < m_ruleCount) && !m_ruleEmitted[r.ruleId])
+	{
+		m_ruleEmitted[r.ruleId] = TRUE;
+		Put((char) EXPORT_REC_RULE);
+		PutRaw(&r.ruleId, sizeof(r.ruleId));
+		PutBinString(r.rule);
+		PutBinString(r.ns);
+		PutBinString(r.tags);
+		PutBinString(r.description);
+	}
+	if ((r.segmentId < m_segmentCount) && !m_segmentEmitted[r.segmentId])
+	{
+		m_segmentEmitted[r.segmentId] = TRUE;
+		Put((char) EXPORT_REC_SEGMENT);
+		PutRaw(&r.segmentId, sizeof(r.segmentId));
+		PutBinString(r.segment);
+	}
+
+	#pragma pack(push, 1)
+	struct
+	{
+		BYTE type;
+		UINT32 ruleId;
+		UINT32 segmentId;
+		UINT64 address;
+		UINT32 length;
+	} rec = { EXPORT_REC_MATCH, r.ruleId, r.segmentId, r.address, r.length };
+	#pragma pack(pop)
+	PutRaw(&rec, sizeof(rec));
+}
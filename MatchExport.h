@@ -0,0 +1,118 @@
+
+// Streaming match result exporters
+#pragma once
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+
+/*
+Streams match records out to a JSON Lines, CSV, or compact binary file as they are produced.
+Has no IDA or libyara dependencies so it can be used from the plugin and from a headless harness alike.
+
+All output goes through a single fixed size write buffer; there are no per record heap allocations.
+String fields are escaped/encoded directly into the write buffer.
+
+Binary format (all values little-endian):
+ Header: "Y4IM" signature, UINT32 format version.
+ Then a stream of records, each starting with a BYTE type:
+  EXPORT_REC_RULE:    UINT32 rule ID, then rule name, namespace, tags, and description strings.
+  EXPORT_REC_SEGMENT: UINT32 segment ID, then segment name string.
+  EXPORT_REC_MATCH:   UINT32 rule ID, UINT32 segment ID, UINT64 address, UINT32 length.
+  EXPORT_REC_END:     UINT64 total match record count.
+ Strings are a UINT16 byte length followed by the UTF-8 bytes (no terminator).
+ A rule or segment definition record is emitted once, just before the first match that references it.
+ Match records with an out of range ID (E.g. an address outside of any segment) have no definition record.
+*/
+
+#define EXPORT_BINARY_SIGNATURE "Y4IM"
+#define EXPORT_BINARY_VERSION 1
+
+enum EXPORT_RECORD_TYPE
+{
+	EXPORT_REC_END,
+	EXPORT_REC_RULE,
+	EXPORT_REC_SEGMENT,
+	EXPORT_REC_MATCH,
+};
+
+// Export input record, one per match.
+// Strings are owned by the caller and only need to stay valid for the duration of the Write() call.
+struct EXPORT_RECORD
+{
+	UINT32 ruleId;		// Zero based rule index, less than the "ruleCount" given to Open()
+	UINT32 segmentId;	// Zero based segment index, less than the "segmentCount" given to Open()
+	UINT64 address;
+	UINT32 length;
+
+	LPCSTR rule;
+	LPCSTR ns;
+	LPCSTR tags;
+	LPCSTR description;
+	LPCSTR segment;
+};
+
+class MatchExporter
+{
+public:
+	enum FORMAT
+	{
+		FORMAT_JSONL,
+		FORMAT_CSV,
+		FORMAT_BINARY
+	};
+
+	MatchExporter();
+	~MatchExporter() { Close(); }
+
+	// Pick the output format from the file extension: ".csv", ".bin" or ".y4im", else JSON Lines
+	static FORMAT FormatFromPath(__in LPCSTR path);
+	static LPCSTR FormatName(FORMAT format);
+
+	// Create/overwrite the output file
+	// "ruleCount" and "segmentCount" size the binary format's emitted definition tables.
+	// Returns TRUE on success
+	BOOL Open(__in LPCWSTR path, FORMAT format, UINT32 ruleCount, UINT32 segmentCount);
+
+	// Write a match record, returns TRUE on success
+	BOOL Write(__in const EXPORT_RECORD &record);
+
+	// Flush and close the output file, returns TRUE on success
+	BOOL Close();
+
+	UINT64 Count() const { return m_count; }
+	UINT64 BytesWritten() const { return m_written; }
+	DWORD LastError() const { return m_lastError; }
+
+private:
+	enum { BUFFER_SIZE = (256 * 1024) };
+
+	HANDLE m_file;
+	FORMAT m_format;
+	BOOL   m_failed;
+	DWORD  m_lastError;
+	UINT64 m_count, m_written;
+	size_t m_used;
+
+	// Binary format "definition already emitted" flags
+	PBYTE  m_ruleEmitted, m_segmentEmitted;
+	UINT32 m_ruleCount, m_segmentCount;
+
+	BYTE m_buffer[BUFFER_SIZE];
+
+	BOOL Flush();
+	inline void Reserve(size_t size) { if ((m_used + size) > BUFFER_SIZE) Flush(); }
+	inline void Put(char c) { Reserve(1); m_buffer[m_used++] = (BYTE) c; }
+	void PutRaw(__in LPCVOID data, size_t size);
+	void PutText(__in LPCSTR text);
+	void PutJsonString(__in_opt LPCSTR text);
+	void PutCsvString(__in_opt LPCSTR text);
+	void PutBinString(__in_opt LPCSTR text);
+	void PutHex(UINT64 value);
+	void PutDecimal(UINT64 value);
+
+	void WriteJsonl(__in const EXPORT_RECORD &r);
+	void WriteCsv(__in const EXPORT_RECORD &r);
+	void WriteBinary(__in const EXPORT_RECORD &r);
+};
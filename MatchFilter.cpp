@@ -0,0 +1,170 @@
+
+// Bitmap indexed match filtering
+#include "stdafx.h"
+#include "MatchFilter.h"
+#include "RuleSelect.h"
+
+void MatchFilterIndex::Init(__in const MATCHES &matches, __in const RuleDisplayCache &rules, __in const SegmentTable &segments)
+{
+	Clear();
+	m_matches = &matches;
+	m_rules = &rules;
+	m_segments = &segments;
+	m_words = ((matches.size() + 63) / 64);
+}
+
+void MatchFilterIndex::Clear()
+{
+	m_matches = NULL;
+	m_rules = NULL;
+	m_segments = NULL;
+	m_words = 0;
+	m_bitsets.clear();
+}
+
+// Is "tag" in a space separated tag list
+static BOOL HasTag(__in LPCSTR tags, __in LPCSTR tag, size_t tagLen)
+{
+	while (*tags)
+	{
+		LPCSTR end = strchr(tags, ' ');
+		size_t len = (end ? (size_t) (end - tags) : strlen(tags));
+		if ((len == tagLen) && (_strnicmp(tags, tag, len) == 0))
+			return TRUE;
+		if (!end)
+			break;
+		tags = (end + 1);
+	}
+	return FALSE;
+}
+
+// Get a term's bitset, building it on first use
+const MatchFilterIndex::BITSET* MatchFilterIndex::GetBitset(__in LPCSTR term, __out qstring &error)
+{
+	std::string key(term);
+	std::transform(key.begin(), key.end(), key.begin(), [](char c) { return (char) tolower((BYTE) c); });
+	auto it = m_bitsets.find(key);
+	if (it != m_bitsets.end())
+		return &it->second;
+
+	LPCSTR name = strchr(term, ':');
+	if (!name || !name[1])
+	{
+		error.sprnt("Bad filter term \"%s\", expected \"tag:\", \"ns:\", or \"seg:\" and a name", term);
+		return NULL;
+	}
+	size_t typeLen = (size_t) (name - term);
+	name++;
+
+	// Which rules or segments have the key
+	qvector<BYTE> hasKey;
+	BOOL bySegment = FALSE, any = FALSE;
+	if ((typeLen == 3) && (_strnicmp(term, "tag", 3) == 0))
+	{
+		size_t nameLen = strlen(name);
+		hasKey.resize(m_rules->Count());
+		for (UINT32 i = 0; i < m_rules->Count(); i++)
+			any |= (hasKey[i] = (BYTE) HasTag(m_rules->Tags(i), name, nameLen));
+	}
+	else
+	if ((typeLen == 2) && (_strnicmp(term, "ns", 2) == 0))
+	{
+		hasKey.resize(m_rules->Count());
+		for (UINT32 i = 0; i < m_rules->Count(); i++)
+			any |= (hasKey[i] = (BYTE) NamespaceMatch(name, m_rules->Namespace(i)));
+	}
+	else
+	if ((typeLen == 3) && (_strnicmp(term, "seg", 3) == 0))
+	{
+		bySegment = TRUE;
+		hasKey.resize(m_segments->Count());
+		for (UINT32 i = 0; i < m_segments->Count(); i++)
+			any |= (hasKey[i] = (BYTE) (_stricmp(m_segments->Name(i), name) == 0));
+	}
+	else
+	{
+		error.sprnt("Unknown filter type in \"%s\", expected \"tag:\", \"ns:\", or \"seg:\"", term);
+		return NULL;
+	}
+	if (!any)
+	{
+		error.sprnt("No %s named \"%s\"", (bySegment ? "segment" : ((typeLen == 2) ? "namespace" : "tag")), name);
+		return NULL;
+	}
+
+	// One pass over the store
+	BITSET &bits = m_bitsets[key];
+	bits.resize(m_words, 0);
+	const MATCHES &matches = *m_matches;
+	UINT32 keyCount = (UINT32) hasKey.size();
+	for (size_t i = 0, count = matches.size(); i < count; i++)
+	{
+		UINT32 index = (bySegment ? matches[i].segment : matches[i].rule);
+		if ((index < keyCount) && hasKey[index])
+			bits[i >> 6] |= (1ull << (i & 63));
+	}
+	return &bits;
+}
+
+BOOL MatchFilterIndex::Filter(__in LPCSTR expression, __out qvector<UINT32> &offsets, __out qstring &error)
+{
+	offsets.clear();
+	error.clear();
+	if (Empty())
+	{
+		error = "No results";
+		return FALSE;
+	}
+
+	BITSET result(m_words, 0), group;
+	qstring tmp(expression);
+	char *nextGroup = NULL;
+	for (char *groupStr = qstrtok(tmp.begin(), "|", &nextGroup); groupStr; groupStr = qstrtok(NULL, "|", &nextGroup))
+	{
+		// AND the group's terms
+		UINT32 terms = 0;
+		char *nextTerm = NULL;
+		for (char *term = qstrtok(groupStr, " \t&", &nextTerm); term; term = qstrtok(NULL, " \t&", &nextTerm))
+		{
+			const BITSET *bits = GetBitset(term, error);
+			if (!bits)
+				return FALSE;
+			if (terms++ == 0)
+				group = *bits;
+			else
+			{
+				for (size_t w = 0; w < m_words; w++)
+					group[w] &= (*bits)[w];
+			}
+		}
+		if (terms == 0)
+		{
+			error = "Empty filter term group";
+			return FALSE;
+		}
+
+		for (size_t w = 0; w < m_words; w++)
+			result[w] |= group[w];
+	}
+
+	// Gather the set bits
+	size_t total = 0;
+	for (UINT64 word : result)
+		total += __popcnt64(word);
+	if (total == 0)
+		return TRUE;
+	offsets.reserve(total);
+
+	for (size_t w = 0; w < m_words; w++)
+	{
+		UINT64 word = result[w];
+		while (word)
+		{
+			DWORD bit;
+			_BitScanForward64(&bit, word);
+			offsets.push_back((UINT32) ((w << 6) + bit));
+			word &= (word - 1);
+		}
+	}
+	return TRUE;
+}
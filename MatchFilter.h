@@ -0,0 +1,43 @@
+
+// Bitmap indexed match filtering
+#pragma once
+
+#include "stdafx.h"
+#include "MatchIndex.h"
+#include "RuleCache.h"
+
+/*
+One bitset over the match store per tag, namespace and segment, a set bit per match that has it.
+A bitset is built in one pass over the store the first time its key is used, then kept for the life of the
+results. Filtering is then just AND/OR over 64 match words and a walk of the set bits.
+
+Filter expressions are terms of the form "tag:NAME", "ns:NAME", or "seg:NAME" (case insensitive).
+Namespaces match like the rule selection's, by the rules file path, file name, or file name without the extension,
+with '*' and '?' wildcards.
+Space or '&' separated terms are ANDed, '|' separated groups are ORed:
+  "tag:AND ns:default_be | seg:.rdata" = (tag AND, in the big endian default rules) or in the .rdata segment
+*/
+class MatchFilterIndex
+{
+public:
+	MatchFilterIndex() : m_matches(NULL), m_rules(NULL), m_segments(NULL), m_words(0) {}
+
+	void Init(__in const MATCHES &matches, __in const RuleDisplayCache &rules, __in const SegmentTable &segments);
+	void Clear();
+	BOOL Empty() const { return (m_matches == NULL); }
+
+	// Evaluate a filter expression into the match store offsets that pass it, in address order.
+	// Returns FALSE with the reason on a bad expression or an unknown key.
+	BOOL Filter(__in LPCSTR expression, __out qvector<UINT32> &offsets, __out qstring &error);
+
+private:
+	typedef qvector<UINT64> BITSET;
+
+	const MATCHES *m_matches;
+	const RuleDisplayCache *m_rules;
+	const SegmentTable *m_segments;
+	size_t m_words;
+	std::map<std::string, BITSET> m_bitsets; // By lower case "type:name" key
+
+	const BITSET* GetBitset(__in LPCSTR term, __out qstring &error);
+};
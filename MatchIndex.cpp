@@ -0,0 +1,104 @@
+
+// Match store indexes
+#include "stdafx.h"
+#include "MatchIndex.h"
+
+void RuleMatchIndex::Build(__in const MATCHES &matches, UINT32 ruleCount)
+{
+	Clear();
+	m_matches = &matches;
+	size_t count = matches.size();
+
+	// Count per rule, then prefix sum into row starts
+	m_start.resize(ruleCount + 1, 0);
+	for (const MATCH &m : matches)
+		m_start[m.rule + 1]++;
+	for (UINT32 i = 0; i < ruleCount; i++)
+		m_start[i + 1] += m_start[i];
+
+	// Distribute in store order, keeping each rule's row address sorted
+	qvector<UINT32> fill(m_start);
+	m_offsets.resize(count);
+	m_rank.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		UINT32 rule = matches[i].rule;
+		UINT32 slot = fill[rule]++;
+		m_offsets[slot] = (UINT32) i;
+		m_rank[i] = (slot - m_start[rule]);
+	}
+}
+
+void RuleMatchIndex::Clear()
+{
+	m_matches = NULL;
+	m_start.clear();
+	m_offsets.clear();
+	m_rank.clear();
+}
+
+size_t RuleMatchIndex::Next(size_t match) const
+{
+	UINT32 rule = (*m_matches)[match].rule;
+	UINT32 rank = (m_rank[match] + 1);
+	return ((rank < Count(rule)) ? Matches(rule)[rank] : (size_t) -1);
+}
+
+size_t RuleMatchIndex::Previous(size_t match) const
+{
+	UINT32 rule = (*m_matches)[match].rule;
+	UINT32 rank = m_rank[match];
+	return ((rank > 0) ? Matches(rule)[rank - 1] : (size_t) -1);
+}
+
+size_t FindMatch(__in const MATCHES &matches, ea_t address)
+{
+	auto it = std::lower_bound(matches.begin(), matches.end(), address, [](const MATCH &m, ea_t ea) { return m.address < ea; });
+	return ((it != matches.end()) ? (size_t) (it - matches.begin()) : (size_t) -1);
+}
+
+void SegmentTable::Build()
+{
+	Clear();
+
+	// IDA keeps segments in address order, so the table stays sorted for Find() as long as missing ones are skipped
+	int count = get_segm_qty();
+	m_index.resize(count, (UINT32) -1);
+	for (int i = 0; i < count; i++)
+	{
+		if (segment_t *seg = getnseg(i))
+		{
+			m_index[i] = (UINT32) m_segments.size();
+			ENTRY &e = m_segments.push_back();
+			e.start = seg->start_ea;
+			e.end = seg->end_ea;
+			e.number = (UINT32) i;
+			get_segm_name(&e.name, seg);
+			m_nameWidth = max(m_nameWidth, (UINT32) e.name.length());
+		}
+	}
+}
+
+UINT32 SegmentTable::Find(ea_t address) const
+{
+	auto it = std::upper_bound(m_segments.begin(), m_segments.end(), address, [](ea_t ea, const ENTRY &e) { return ea < e.start; });
+	if (it != m_segments.begin())
+	{
+		--it;
+		if ((address >= it->start) && (address < it->end))
+			return it->number;
+	}
+	return (UINT32) -1;
+}
+
+void SegmentTable::AssignSegments(__inout MATCHES &matches) const
+{
+	// Single merge walk since both are address sorted
+	size_t i = 0, count = m_segments.size();
+	for (MATCH &m : matches)
+	{
+		while ((i < count) && (m.address >= m_segments[i].end))
+			i++;
+		m.segment = (((i < count) && (m.address >= m_segments[i].start)) ? m_segments[i].number : (UINT32) -1);
+	}
+}
@@ -0,0 +1,81 @@
+
+// Match store indexes
+#pragma once
+
+#include "stdafx.h"
+
+/*
+Rule to matches index.
+Built once after the sorted merge with a counting sort in O(matches + rules) time, then stored as
+compressed rows (CSR) of offsets into the match store. Since the store is address sorted, each rule's row is
+too. The per match rank (its position within its rule's row) makes next/previous steps O(1).
+*/
+class RuleMatchIndex
+{
+public:
+	RuleMatchIndex() : m_matches(NULL) {}
+
+	void Build(__in const MATCHES &matches, UINT32 ruleCount);
+	void Clear();
+
+	BOOL Empty() const { return m_offsets.empty(); }
+	UINT32 RuleCount() const { return (m_start.empty() ? 0 : (UINT32) (m_start.size() - 1)); }
+
+	// Match count of a rule
+	UINT32 Count(UINT32 rule) const { return (m_start[rule + 1] - m_start[rule]); }
+
+	// A rule's match store offsets, in address order
+	const UINT32* Matches(UINT32 rule) const { return &m_offsets[m_start[rule]]; }
+
+	// Position of a match within its rule's matches
+	UINT32 Rank(size_t match) const { return m_rank[match]; }
+
+	// Store offset of the next/previous match of the same rule, or -1 if none
+	size_t Next(size_t match) const;
+	size_t Previous(size_t match) const;
+
+private:
+	const MATCHES *m_matches;
+	qvector<UINT32> m_start;	// Rule row starts, size ruleCount + 1
+	qvector<UINT32> m_offsets;	// Match store offsets grouped by rule
+	qvector<UINT32> m_rank;		// Per match position in its rule's row
+};
+
+/*
+Flat, address sorted table of the IDB segments.
+Built once per result set in O(segments) time. Matches carry their segment number from the scan, so the
+chooser rows index straight into this table instead of doing a getseg() and a name lookup per row.
+*/
+class SegmentTable
+{
+public:
+	void Build();
+	void Clear() { m_segments.clear(); m_index.clear(); m_nameWidth = 0; }
+	UINT32 Count() const { return (UINT32) m_index.size(); } // Segment number range, including any missing ones
+
+	// Segment name by IDA segment number
+	LPCSTR Name(UINT32 segment) const { return (((segment < m_index.size()) && (m_index[segment] != (UINT32) -1)) ? m_segments[m_index[segment]].name.c_str() : "?????"); }
+
+	// Longest segment name length, for aligned address columns
+	UINT32 NameWidth() const { return m_nameWidth; }
+
+	// Segment number containing an address, or -1 if none
+	UINT32 Find(ea_t address) const;
+
+	// Set the segment numbers of address sorted matches that have none, like the ones restored from the IDB
+	void AssignSegments(__inout MATCHES &matches) const;
+
+private:
+	struct ENTRY
+	{
+		ea_t start, end;
+		UINT32 number;	// IDA segment number
+		qstring name;
+	};
+	qvector<ENTRY> m_segments;	// Address sorted
+	qvector<UINT32> m_index;	// Segment number to table index, -1 for none
+	UINT32 m_nameWidth = 0;
+};
+
+// Find the first match at or after an address in the address sorted match store, -1 if none
+size_t FindMatch(__in const MATCHES &matches, ea_t address);
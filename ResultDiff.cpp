@@ -0,0 +1,203 @@
+
+// Run to run result diffing
+#include "stdafx.h"
+#include "ResultDiff.h"
+#include "MatchIndex.h"
+
+// Map each set's rules to a common rule table
+static void UnifyRules(__inout MATCHES &matches, __in const RULE_STRINGS_TABLE &rules, __inout std::map<std::string, UINT32> &keys, __inout RULE_STRINGS_TABLE &diffRules)
+{
+	std::vector<UINT32> remap(rules.size());
+	for (size_t i = 0; i < rules.size(); i++)
+	{
+		const RULE_STRINGS &rs = rules[i];
+		std::string key(rs.ns.c_str());
+		key += '\x01';
+		key += rs.name.c_str();
+
+		auto it = keys.find(key);
+		if (it == keys.end())
+		{
+			it = keys.emplace(key, (UINT32) diffRules.size()).first;
+			diffRules.push_back(rs);
+		}
+		remap[i] = it->second;
+	}
+
+	for (MATCH &m : matches)
+		m.rule = remap[m.rule];
+
+	// Already address sorted, restore the rule order within same address runs for the merge compare
+	for (size_t i = 0, count = matches.size(); i < count;)
+	{
+		size_t j = (i + 1);
+		while ((j < count) && (matches[j].address == matches[i].address))
+			j++;
+		if ((j - i) > 1)
+			std::sort(matches.begin() + i, matches.begin() + j, MATCH());
+		i = j;
+	}
+}
+
+void DiffResults(__inout MATCHES &previous, __in const RULE_STRINGS_TABLE &previousRules,
+				 __inout MATCHES &current, __in const RULE_STRINGS_TABLE &currentRules,
+				 __out DIFF_ENTRIES &diff, __out RULE_STRINGS_TABLE &diffRules)
+{
+	diff.clear();
+	diffRules.clear();
+
+	std::map<std::string, UINT32> keys;
+	UnifyRules(previous, previousRules, keys, diffRules);
+	UnifyRules(current, currentRules, keys, diffRules);
+
+	// Single merge pass over both sorted sets. Equal (address, rule) pairs cancel out.
+	MATCH less;
+	size_t i = 0, j = 0;
+	size_t pc = previous.size(), cc = current.size();
+	while ((i < pc) || (j < cc))
+	{
+		if ((j == cc) || ((i < pc) && less(previous[i], current[j])))
+		{
+			diff.push_back({ previous[i].address, previous[i].rule, FALSE });
+			i++;
+		}
+		else
+		if ((i == pc) || less(current[j], previous[i]))
+		{
+			diff.push_back({ current[j].address, current[j].rule, TRUE });
+			j++;
+		}
+		else
+			i++, j++;
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+
+#define DIFF_CHOOSER_TITLE "{ YARA Matches Diff }"
+
+// Added/removed matches chooser
+class DiffChooser : public chooser_t
+{
+	enum COLUMNS
+	{
+		COL_CHANGE,
+		COL_ADDRESS,
+		COL_DESCRIPTION,
+		COL_TAGS,
+		COL_FILE,
+
+		COL_COUNT
+	};
+
+	static int _widths[COL_COUNT];
+	static const char *_header[COL_COUNT];
+	static const char _title[];
+
+	DIFF_ENTRIES diff;
+	RULE_STRINGS_TABLE rules;
+	SegmentTable segments;
+
+public:
+	DiffChooser(__inout DIFF_ENTRIES &_diff, __inout RULE_STRINGS_TABLE &_rules, int _icon) : chooser_t(CH_QFTYP_DEFAULT, _countof(_header), _widths, _header, _title)
+	{
+		diff.swap(_diff);
+		rules.swap(_rules);
+		segments.Build();
+		icon = _icon;
+	}
+
+	virtual const void* get_obj_id(size_t *len) const
+	{
+		*len = strlen(title);
+		return title;
+	}
+
+	virtual size_t get_count() const { return diff.size(); }
+
+	virtual cbret_t enter(size_t n)
+	{
+		if (n < diff.size())
+			jumpto(diff[n].address);
+		return cbret_t();
+	}
+
+	virtual void get_row(qstrvec_t *cols_, int *icon_, chooser_item_attrs_t *attributes, size_t n) const
+	{
+		try
+		{
+			qstrvec_t &cols = *cols_;
+			const DIFF_ENTRY &e = diff[n];
+			const RULE_STRINGS &rs = rules[e.rule];
+
+			cols[COL_CHANGE] = (e.added ? "+ added" : "- removed");
+
+			cols[COL_ADDRESS].sprnt("%s:%llX", segments.Name(segments.Find(e.address)), (UINT64) e.address);
+
+			cols[COL_DESCRIPTION] = (!rs.description.empty() ? rs.description : rs.name);
+			cols[COL_TAGS] = rs.tags;
+			cols[COL_FILE] = rs.ns;
+
+			// Green for added, red for removed
+			attributes->color = (e.added ? 0xD0FFD0 : 0xD0D0FF);
+			*icon_ = -1;
+		}
+		CATCH()
+	}
+};
+
+const char DiffChooser::_title[] = { DIFF_CHOOSER_TITLE };
+const char* DiffChooser::_header[COL_COUNT] = { "Change", "Address", "Description", "Tags", "File" };
+int DiffChooser::_widths[COL_COUNT] = { /*Change*/ 8, /*Address*/ 12, /*Description*/ 40, /*Tags*/ 8, /*File*/ 20 };
+
+void ShowResultsDiff(int icon)
+{
+	try
+	{
+		TIMESTAMP startTime = GetTimeStamp();
+		MATCHES previous, current;
+		RULE_STRINGS_TABLE previousRules, currentRules;
+		RESULTS_INFO previousInfo, currentInfo;
+		if (!LoadResults(current, currentRules, currentInfo) || !LoadResults(previous, previousRules, previousInfo, TRUE))
+		{
+			msg(MSG_TAG "Need two saved result sets to diff, run another scan first.\n");
+			return;
+		}
+
+		DIFF_ENTRIES diff;
+		RULE_STRINGS_TABLE diffRules;
+		DiffResults(previous, previousRules, current, currentRules, diff, diffRules);
+
+		size_t added = 0;
+		for (const DIFF_ENTRY &e : diff)
+			added += (e.added != FALSE);
+
+		char numBuff1[32], numBuff2[32], numBuff3[32], numBuff4[32], timeBuff1[32], timeBuff2[32];
+		qstrftime64(timeBuff1, sizeof(timeBuff1), "%Y-%m-%d %H:%M:%S", previousInfo.savedTime);
+		qstrftime64(timeBuff2, sizeof(timeBuff2), "%Y-%m-%d %H:%M:%S", currentInfo.savedTime);
+		msg("\n>> " MSG_TAG "Diff of %s matches (%s) against %s matches (%s)\n", NumberCommaString(currentInfo.matchCount, numBuff1), timeBuff2,
+			NumberCommaString(previousInfo.matchCount, numBuff2), timeBuff1);
+		if (previousInfo.rulesHash != currentInfo.rulesHash)
+			msg("Rules changed: \"%s\" %016llX -> \"%s\" %016llX\n", previousInfo.rulesPath.c_str(), previousInfo.rulesHash, currentInfo.rulesPath.c_str(), currentInfo.rulesHash);
+		msg("%s added, %s removed, in %s\n", NumberCommaString(added, numBuff3), NumberCommaString(diff.size() - added, numBuff4), TimeString(GetTimeStamp() - startTime));
+
+		if (diff.empty())
+		{
+			msg("No changes.\n");
+			return;
+		}
+
+		// Free the source sets before the chooser takes over the diff
+		MATCHES().swap(previous);
+		MATCHES().swap(current);
+
+		// Replace an open diff, a chooser with the same title would just be brought to the front with its old rows
+		if (TWidget *widget = find_widget(DIFF_CHOOSER_TITLE))
+			close_widget(widget, 0);
+
+		DiffChooser *chooser = new DiffChooser(diff, diffRules, icon);
+		if (chooser)
+			chooser->choose();
+	}
+	CATCH()
+}
@@ -0,0 +1,24 @@
+
+// Run to run result diffing
+#pragma once
+
+#include "ResultStore.h"
+
+// An added or removed match
+struct DIFF_ENTRY
+{
+	ea_t address;
+	UINT32 rule;	// Diff rule table index
+	BOOL added;		// Else removed
+};
+typedef qvector<DIFF_ENTRY> DIFF_ENTRIES;
+
+// Diff two address sorted result sets in a single linear merge pass.
+// Rules are matched up across the sets by namespace and name since the rule indexes differ between runs.
+// Both match sets get their MATCH::rule values remapped to the returned "diffRules" table.
+void DiffResults(__inout MATCHES &previous, __in const RULE_STRINGS_TABLE &previousRules,
+				 __inout MATCHES &current, __in const RULE_STRINGS_TABLE &currentRules,
+				 __out DIFF_ENTRIES &diff, __out RULE_STRINGS_TABLE &diffRules);
+
+// Show the added and removed matches between the last two saved result sets in a chooser
+void ShowResultsDiff(int icon);
@@ -0,0 +1,254 @@
+
+// Scan results persisted inside the IDB
+#include "stdafx.h"
+#include "ResultStore.h"
+#include "Hash.h"
+
+#define RESULTS_NODE_NAME "$ yara4ida"
+#define RESULTS_BLOB_TAG  'R'
+#define PREVIOUS_BLOB_TAG 'P'
+#define COMMENTS_TAG      'C'
+#define RESULTS_SIGNATURE 0x52493459 // "Y4IR"
+#define RESULTS_VERSION   1
+
+// Get the rule "description" meta string if it has one
+static LPCSTR GetDescription(__in YR_RULE *rule)
+{
+	YR_META *meta;
+	yr_rule_metas_foreach(rule, meta)
+	{
+		if ((meta->type == META_TYPE_STRING) && meta->identifier && (strcmp(meta->identifier, "description") == 0))
+			return meta->string;
+	}
+	return NULL;
+}
+
+// Hash a rule's identifier, optional namespace name, tags, metas, and strings
+static UINT64 HashRuleParts(UINT64 hash, __in YR_RULE *rule, __in_opt LPCSTR ns)
+{
+	hash = fnv64(hash, rule->identifier);
+	if (ns)
+		hash = fnv64(hash, ns);
+
+	LPCSTR tag_name;
+	yr_rule_tags_foreach(rule, tag_name)
+		hash = fnv64(hash, tag_name);
+
+	YR_META *meta;
+	yr_rule_metas_foreach(rule, meta)
+	{
+		hash = fnv64(hash, meta->identifier);
+		if (meta->type == META_TYPE_STRING)
+			hash = fnv64(hash, meta->string);
+		else
+			hash = fnv64(hash, &meta->integer, sizeof(meta->integer));
+	}
+
+	YR_STRING *str;
+	yr_rule_strings_foreach(rule, str)
+	{
+		UINT32 flags = (str->flags & ~STRING_FLAGS_DISABLED);
+		hash = fnv64(hash, &flags, sizeof(flags));
+		hash = fnv64(hash, &str->length, sizeof(str->length));
+		hash = fnv64(hash, str->string, str->length);
+	}
+	return hash;
+}
+
+UINT64 HashRules(__in const RULE_SETS &rules)
+{
+	UINT64 hash = FNV64_BASIS;
+	UINT32 count = rules.Count();
+	hash = fnv64(hash, &count, sizeof(count));
+
+	for (UINT32 i = 0; i < count; i++)
+		hash = HashRuleParts(hash, rules.Rule(i), rules.Namespace(i));
+	return hash;
+}
+
+UINT64 HashRule(__in YR_RULE *rule)
+{
+	return HashRuleParts(FNV64_BASIS, rule, NULL);
+}
+
+BOOL SaveResults(__in const MATCHES &matches, __in const RULE_SETS &rules, __in LPCSTR rulesPath, __out_opt size_t *blobSize)
+{
+	try
+	{
+		// Only the rules with matches go in the rule table
+		std::vector<UINT32> remap(rules.Count(), MAXUINT32);
+		std::vector<UINT32> used;
+		for (const MATCH &m : matches)
+		{
+			if (remap[m.rule] == MAXUINT32)
+			{
+				remap[m.rule] = (UINT32) used.size();
+				used.push_back(m.rule);
+			}
+		}
+
+		bytevec_t blob;
+		blob.reserve(64 + (used.size() * 96) + (matches.size() * 4));
+		blob.pack_dd(RESULTS_SIGNATURE);
+		blob.pack_dd(RESULTS_VERSION);
+		blob.pack_dq(HashRules(rules));
+		blob.pack_dq(qtime64());
+		blob.pack_str(rulesPath);
+
+		blob.pack_dd((UINT32) used.size());
+		for (UINT32 index : used)
+		{
+			YR_RULE *rule = rules.Rule(index);
+			qstring tags;
+			LPCSTR tag_name;
+			yr_rule_tags_foreach(rule, tag_name)
+			{
+				if (!tags.empty())
+					tags += ' ';
+				tags += tag_name;
+			}
+			LPCSTR description = GetDescription(rule);
+
+			blob.pack_str(rule->identifier ? rule->identifier : "");
+			blob.pack_str(rules.Namespace(index));
+			blob.pack_str(tags);
+			blob.pack_str(description ? description : "");
+		}
+
+		blob.pack_dd((UINT32) matches.size());
+		ea_t previous = 0;
+		for (const MATCH &m : matches)
+		{
+			blob.pack_ea(m.address - previous);
+			blob.pack_dd(remap[m.rule]);
+			blob.pack_dd(m.length);
+			previous = m.address;
+		}
+
+		// Keep the last results as the previous set for diffing
+		netnode node(RESULTS_NODE_NAME, 0, true);
+		bytevec_t last;
+		if (node.getblob(&last, 0, RESULTS_BLOB_TAG) > 0)
+		{
+			node.delblob(0, PREVIOUS_BLOB_TAG);
+			node.setblob(last.begin(), last.size(), 0, PREVIOUS_BLOB_TAG);
+			last.clear();
+		}
+
+		node.delblob(0, RESULTS_BLOB_TAG);
+		if (node.setblob(blob.begin(), blob.size(), 0, RESULTS_BLOB_TAG))
+		{
+			if (blobSize)
+				*blobSize = blob.size();
+			return TRUE;
+		}
+	}
+	CATCH()
+	return FALSE;
+}
+
+BOOL LoadResults(__out MATCHES &matches, __out RULE_STRINGS_TABLE &rules, __out RESULTS_INFO &info, BOOL previous)
+{
+	matches.clear();
+	rules.clear();
+
+	try
+	{
+		netnode node(RESULTS_NODE_NAME);
+		if (node == BADNODE)
+			return FALSE;
+
+		bytevec_t blob;
+		if (node.getblob(&blob, 0, (previous ? PREVIOUS_BLOB_TAG : RESULTS_BLOB_TAG)) <= 0)
+			return FALSE;
+
+		memory_deserializer_t data(blob.begin(), blob.size());
+		if ((data.unpack_dd() != RESULTS_SIGNATURE) || (data.unpack_dd() != RESULTS_VERSION))
+		{
+			msg(MSG_TAG "* Saved results are from an incompatible version, ignored *\n");
+			return FALSE;
+		}
+		info.rulesHash = data.unpack_dq();
+		info.savedTime = data.unpack_dq();
+		data.unpack_str(&info.rulesPath);
+
+		info.ruleCount = data.unpack_dd();
+		rules.resize(info.ruleCount);
+		for (RULE_STRINGS &rule : rules)
+		{
+			data.unpack_str(&rule.name);
+			data.unpack_str(&rule.ns);
+			data.unpack_str(&rule.tags);
+			data.unpack_str(&rule.description);
+		}
+
+		info.matchCount = data.unpack_dd();
+		matches.resize(info.matchCount);
+		ea_t address = 0;
+		for (MATCH &m : matches)
+		{
+			address += data.unpack_ea();
+			m.address = address;
+			m.rule = data.unpack_dd();
+			m.length = data.unpack_dd();
+			m.segment = (UINT32) -1; // Not stored, segments can change between sessions
+			if (m.rule >= info.ruleCount)
+			{
+				msg(MSG_TAG "** Saved results are corrupt **\n");
+				matches.clear();
+				rules.clear();
+				return FALSE;
+			}
+		}
+		return TRUE;
+	}
+	CATCH()
+
+	matches.clear();
+	rules.clear();
+	return FALSE;
+}
+
+BOOL HaveSavedResults(BOOL previous)
+{
+	netnode node(RESULTS_NODE_NAME);
+	return ((node != BADNODE) && (node.blobsize(0, (previous ? PREVIOUS_BLOB_TAG : RESULTS_BLOB_TAG)) > 0));
+}
+
+// ------------------------------------------------------------------------------------------------
+
+BOOL GetPlacedComment(ea_t address, __out qstring &text)
+{
+	netnode node(RESULTS_NODE_NAME);
+	return ((node != BADNODE) && (node.supstr(&text, (nodeidx_t) address, COMMENTS_TAG) > 0));
+}
+
+void SetPlacedComment(ea_t address, __in LPCSTR text)
+{
+	netnode node(RESULTS_NODE_NAME, 0, true);
+	node.supset((nodeidx_t) address, text, 0, COMMENTS_TAG);
+}
+
+void DelPlacedComment(ea_t address)
+{
+	netnode node(RESULTS_NODE_NAME);
+	if (node != BADNODE)
+		node.supdel((nodeidx_t) address, COMMENTS_TAG);
+}
+
+ea_t NextPlacedComment(ea_t address)
+{
+	netnode node(RESULTS_NODE_NAME);
+	if (node == BADNODE)
+		return BADADDR;
+	nodeidx_t next = ((address == BADADDR) ? node.supfirst(COMMENTS_TAG) : node.supnext((nodeidx_t) address, COMMENTS_TAG));
+	return ((next != BADNODE) ? (ea_t) next : BADADDR);
+}
+
+size_t PlacedCommentCount()
+{
+	size_t count = 0;
+	for (ea_t address = NextPlacedComment(BADADDR); address != BADADDR; address = NextPlacedComment(address))
+		count++;
+	return count;
+}
@@ -0,0 +1,66 @@
+
+// Scan results persisted inside the IDB
+#pragma once
+
+#include "stdafx.h"
+
+/*
+The last scan results are saved to a netnode blob so they can be shown again later (even after the IDB
+is closed and reopened) without initializing libyara, compiling, or rescanning.
+On save the prior results blob is kept as the "previous" set for run to run diffing.
+
+Blob layout, IDA variable length packed (bytevec_t::pack_xx()) values:
+ Header: signature, version, rules hash, save time, rules path string.
+ Rule table: count, then for each rule that has matches: name, namespace, tags, description strings.
+ Matches: count, then per match in address sorted order: address delta, rule table index, match length.
+Sorted address deltas are mostly small, so a match typically packs down to 3 to 5 bytes.
+*/
+
+// Rule display strings for restored results
+struct RULE_STRINGS
+{
+	qstring name;
+	qstring ns;
+	qstring tags;			// Space separated
+	qstring description;	// Empty if the rule has no "description" meta
+};
+typedef qvector<RULE_STRINGS> RULE_STRINGS_TABLE;
+
+// Saved results header info
+struct RESULTS_INFO
+{
+	UINT64 rulesHash;
+	qtime64_t savedTime;
+	UINT32 ruleCount;
+	UINT32 matchCount;
+	qstring rulesPath;
+};
+
+// Content hash of the compiled rule sets; identifies the rules a result set came from
+UINT64 HashRules(__in const RULE_SETS &rules);
+
+// Content hash of one rule, less its namespace; the same rule loaded from two rules files hashes the same.
+// The condition isn't part of it, libyara doesn't keep it in a comparable form.
+UINT64 HashRule(__in YR_RULE *rule);
+
+// Save sorted matches from a live scan, returns TRUE on success
+BOOL SaveResults(__in const MATCHES &matches, __in const RULE_SETS &rules, __in LPCSTR rulesPath, __out_opt size_t *blobSize = NULL);
+
+// Load the last (or the previous) saved results; the restored MATCH::rule values index the returned rule table
+// Returns TRUE on success
+BOOL LoadResults(__out MATCHES &matches, __out RULE_STRINGS_TABLE &rules, __out RESULTS_INFO &info, BOOL previous = FALSE);
+
+BOOL HaveSavedResults(BOOL previous = FALSE);
+
+/*
+Index of the match comments we placed, a netnode supval array keyed by item address holding the exact text we
+added to the item's comment. Lets a rescan skip unchanged items without fetching their comments, replace or
+strip just our part of a comment even next to user text, and remove all of ours in one address ordered pass.
+*/
+BOOL GetPlacedComment(ea_t address, __out qstring &text);
+void SetPlacedComment(ea_t address, __in LPCSTR text);
+void DelPlacedComment(ea_t address);
+
+// Indexed comment addresses in ascending order. BADADDR gets the first, returns BADADDR at the end.
+ea_t NextPlacedComment(ea_t address);
+size_t PlacedCommentCount();
@@ -0,0 +1,150 @@
+
+// Chooser row string cache
+#include "stdafx.h"
+#include "RowCache.h"
+
+RowCache::RowCache(UINT32 columns, __in FORMATTER formatter) : m_formatter(formatter), m_columns(columns), m_rowCount(0), m_clock(0), m_hits(0), m_misses(0)
+{
+	m_scratch.resize(columns);
+	Reset(0);
+}
+
+void RowCache::Reset(size_t rowCount)
+{
+	m_rowCount = rowCount;
+	for (PAGE &page : m_pages)
+	{
+		page.first = (size_t) -1;
+		page.lastUse = 0;
+		page.pool.clear();
+		page.offsets.clear();
+	}
+}
+
+RowCache::PAGE& RowCache::GetPage(size_t row)
+{
+	size_t first = (row - (row % PAGE_ROWS));
+	m_clock++;
+
+	// Few enough pages that a linear search beats any lookup structure
+	PAGE *lru = &m_pages[0];
+	for (PAGE &page : m_pages)
+	{
+		if (page.first == first)
+		{
+			page.lastUse = m_clock;
+			m_hits++;
+			return page;
+		}
+		if (page.lastUse < lru->lastUse)
+			lru = &page;
+	}
+
+	// Miss, format the page into the least recently used slot. Pool capacity is reused.
+	m_misses++;
+	PAGE &page = *lru;
+	page.first = first;
+	page.lastUse = m_clock;
+	page.pool.qclear();
+	page.offsets.qclear();
+
+	size_t last = (((first + PAGE_ROWS) < m_rowCount) ? (first + PAGE_ROWS) : m_rowCount);
+	for (size_t i = first; i < last; i++)
+	{
+		m_formatter(i, m_scratch);
+		for (UINT32 c = 0; c < m_columns; c++)
+		{
+			const qstring &str = m_scratch[c];
+			size_t offset = page.pool.size(), len = (str.length() + 1);
+			page.offsets.push_back((UINT32) offset);
+			page.pool.resize(offset + len);
+			memcpy(&page.pool[offset], str.c_str(), len);
+		}
+	}
+	return page;
+}
+
+void RowCache::Get(size_t row, __out qstrvec_t &cols)
+{
+	if (row >= m_rowCount)
+		return;
+
+	PAGE &page = GetPage(row);
+	const UINT32 *offsets = &page.offsets[(row - page.first) * m_columns];
+	for (UINT32 c = 0; c < m_columns; c++)
+		cols[c] = &page.pool[offsets[c]];
+}
+
+size_t RowCache::MemoryUsed() const
+{
+	size_t size = sizeof(*this);
+	for (const PAGE &page : m_pages)
+		size += (page.pool.capacity() + (page.offsets.capacity() * sizeof(UINT32)));
+	return size;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+#ifdef _DEBUG
+static SIZE_T WorkingSetSize()
+{
+	PROCESS_MEMORY_COUNTERS pmc = { sizeof(pmc) };
+	GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+	return pmc.WorkingSetSize;
+}
+
+// Scroll through a synthetic match store the way the chooser does, at increasing sizes.
+// The row cache and the working set growth during display should stay flat while the store grows.
+void RowCacheBenchmark()
+{
+	static const size_t sizes[] = { 1000000, 10000000, 50000000 };
+	static const char *tags[] = { "AND", "CRC", "AES", "" };
+
+	msg("\n" MSG_TAG "Row cache benchmark, MATCH size: %u bytes:\n", (UINT32) sizeof(MATCH));
+	for (size_t count : sizes)
+	{
+		MATCHES store;
+		store.resize(count);
+		for (size_t i = 0; i < count; i++)
+			store[i] = { (0x140001000ull + (i * 12)), (UINT32) (i % 1500), 16, 0 };
+		SIZE_T baseline = WorkingSetSize();
+
+		RowCache cache(4, [&store](size_t row, qstrvec_t &cols)
+		{
+			const MATCH &m = store[row];
+			cols[0].sprnt(".text:%llX", (UINT64) m.address);
+			cols[1].sprnt("Synthetic rule %u description", m.rule);
+			cols[2] = tags[m.rule & 3];
+			cols[3] = "synthetic.yar";
+		});
+		cache.Reset(count);
+
+		// Page down through a window, then jump around like scroll bar drags
+		qstrvec_t cols;
+		cols.resize(4);
+		TIMESTAMP startTime = GetTimeStamp();
+		UINT64 rows = 0;
+		for (size_t i = 0; i < 250000; i++, rows++)
+			cache.Get(i, cols);
+		UINT64 random = 0x9E3779B97F4A7C15ull;
+		for (UINT32 jump = 0; jump < 20000; jump++)
+		{
+			random ^= (random << 13);
+			random ^= (random >> 7);
+			random ^= (random << 17);
+			size_t top = (size_t) (random % count);
+			for (size_t i = top; (i < (top + 40)) && (i < count); i++, rows++)
+				cache.Get(i, cols);
+		}
+		TIMESTAMP elapsed = (GetTimeStamp() - startTime);
+
+		SIZE_T workingSet = WorkingSetSize();
+		char numBuff1[32], numBuff2[32];
+		msg(" %s matches: store %s, row cache %s, display working set growth %s, %s rows in %s, %.1f%% hits\n",
+			NumberCommaString(count, numBuff1), byteSizeString(count * sizeof(MATCH)), byteSizeString(cache.MemoryUsed()),
+			byteSizeString((workingSet > baseline) ? (workingSet - baseline) : 0), NumberCommaString(rows, numBuff2), TimeString(elapsed),
+			((double) cache.Hits() * 100.0) / (double) (cache.Hits() + cache.Misses()));
+		REFRESH_UI();
+	}
+}
+#endif
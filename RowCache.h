@@ -0,0 +1,62 @@
+
+// Chooser row string cache
+#pragma once
+
+#include "stdafx.h"
+#include <functional>
+
+/*
+Paged LRU cache of formatted chooser row strings.
+IDA asks for rows one at a time, for the visible ones and again on every scroll and repaint. Rows are formatted a page
+of consecutive rows at a time into one string pool per page, and only a fixed number of pages are kept, so the memory
+used for display stays constant no matter how many matches there are. Neighbouring rows (the next scroll step) are
+usually already in the page just formatted.
+*/
+class RowCache
+{
+public:
+	// Formats one row's columns
+	typedef std::function<void(size_t row, qstrvec_t &cols)> FORMATTER;
+
+	RowCache(UINT32 columns, __in FORMATTER formatter);
+
+	// Set the row count and drop all cached pages
+	void Reset(size_t rowCount);
+
+	// Copy a row's column strings out
+	void Get(size_t row, __out qstrvec_t &cols);
+
+	// Bytes held by the cached pages
+	size_t MemoryUsed() const;
+
+	UINT64 Hits() const { return m_hits; }
+	UINT64 Misses() const { return m_misses; }
+
+	enum
+	{
+		PAGE_ROWS = 64,
+		PAGE_COUNT = 32	// Several screens worth
+	};
+
+private:
+	struct PAGE
+	{
+		size_t first;			// First row, -1 if unused
+		UINT64 lastUse;
+		qvector<char> pool;		// Row column strings
+		qvector<UINT32> offsets;// Pool offset per row column
+	};
+	PAGE m_pages[PAGE_COUNT];
+	FORMATTER m_formatter;
+	UINT32 m_columns;
+	size_t m_rowCount;
+	UINT64 m_clock, m_hits, m_misses;
+	qstrvec_t m_scratch;
+
+	PAGE& GetPage(size_t row);
+};
+
+#ifdef _DEBUG
+// Synthetic benchmark: display memory and row cost with up to 50M matches
+void RowCacheBenchmark();
+#endif
@@ -0,0 +1,83 @@
+
+// Per rule display string cache
+#include "stdafx.h"
+#include "RuleCache.h"
+
+UINT32 RuleDisplayCache::Intern(__in_opt LPCSTR str)
+{
+	if (!str)
+		str = "";
+
+	auto it = m_interned.find(str);
+	if (it != m_interned.end())
+		return it->second;
+
+	UINT32 offset = (UINT32) m_pool.size();
+	size_t len = (strlen(str) + 1);
+	m_pool.resize(m_pool.size() + len);
+	memcpy(&m_pool[offset], str, len);
+	m_interned.emplace(str, offset);
+	return offset;
+}
+
+void RuleDisplayCache::Add(__in LPCSTR name, __in_opt LPCSTR description, __in LPCSTR tags, __in_opt LPCSTR ns)
+{
+	ENTRY e;
+	e.name = Intern(name);
+	e.description = Intern(description);
+	e.tags = Intern(tags);
+	e.ns = Intern((ns && ns[0]) ? ns : "?????");
+	m_entries.push_back(e);
+}
+
+void RuleDisplayCache::Build(__in const RULE_SETS &rules)
+{
+	Clear();
+	m_entries.reserve(rules.Count());
+
+	for (UINT32 i = 0; i < rules.Count(); i++)
+	{
+		YR_RULE *rule = rules.Rule(i);
+
+		// Description meta if it has one
+		LPCSTR description = NULL;
+		YR_META *meta;
+		yr_rule_metas_foreach(rule, meta)
+		{
+			if ((meta->type == META_TYPE_STRING) && meta->identifier && (strcmp(meta->identifier, "description") == 0))
+			{
+				description = meta->string;
+				break;
+			}
+		}
+
+		// Space separated, the same as the IDB rule table has them
+		qstring tags;
+		LPCSTR tag_name;
+		yr_rule_tags_foreach(rule, tag_name)
+		{
+			if (!tags.empty())
+				tags += ' ';
+			tags += tag_name;
+		}
+
+		Add((rule->identifier ? rule->identifier : "?????"), description, tags.c_str(), rules.Namespace(i));
+	}
+	m_interned.clear();
+}
+
+void RuleDisplayCache::Build(__in const RULE_STRINGS_TABLE &rules)
+{
+	Clear();
+	m_entries.reserve(rules.size());
+	for (const RULE_STRINGS &rs : rules)
+		Add(rs.name.c_str(), rs.description.c_str(), rs.tags.c_str(), rs.ns.c_str());
+	m_interned.clear();
+}
+
+void RuleDisplayCache::Clear()
+{
+	m_entries.clear();
+	m_pool.clear();
+	m_interned.clear();
+}
@@ -0,0 +1,41 @@
+
+// Per rule display string cache
+#pragma once
+
+#include "stdafx.h"
+#include "ResultStore.h"
+
+/*
+Rule display strings (name, description, tags, namespace) indexed by rule index.
+Built once per result set from either the live libyara rules or the restored IDB rule table, so the chooser
+row callbacks (and the match export) only copy strings out instead of walking the rule metas and tags every redraw.
+All strings are interned into a single pool; the many rules sharing the same namespace or tags share one copy.
+*/
+class RuleDisplayCache
+{
+public:
+	void Build(__in const RULE_SETS &rules);
+	void Build(__in const RULE_STRINGS_TABLE &rules);
+	void Clear();
+
+	BOOL Empty() const { return m_entries.empty(); }
+	UINT32 Count() const { return (UINT32) m_entries.size(); }
+
+	LPCSTR Name(UINT32 rule) const { return &m_pool[m_entries[rule].name]; }
+	LPCSTR Description(UINT32 rule) const { LPCSTR d = DescriptionMeta(rule); return (d[0] ? d : Name(rule)); } // The rule name if it has no "description" meta
+	LPCSTR DescriptionMeta(UINT32 rule) const { return &m_pool[m_entries[rule].description]; } // Empty if none
+	LPCSTR Tags(UINT32 rule) const { return &m_pool[m_entries[rule].tags]; } // Space separated
+	LPCSTR Namespace(UINT32 rule) const { return &m_pool[m_entries[rule].ns]; }
+
+private:
+	struct ENTRY
+	{
+		UINT32 name, description, tags, ns; // String pool offsets
+	};
+	qvector<ENTRY> m_entries;
+	qvector<char> m_pool;
+	std::map<std::string, UINT32> m_interned; // Only used while building
+
+	UINT32 Intern(__in_opt LPCSTR str);
+	void Add(__in LPCSTR name, __in_opt LPCSTR description, __in LPCSTR tags, __in_opt LPCSTR ns);
+};
@@ -0,0 +1,406 @@
+
+// Compile time rule cost report
+#include "stdafx.h"
+#include "RuleCost.h"
+#include "RuleLoader.h"
+#include <yara/ahocorasick.h>
+#include <tuple>
+
+// An atom the automaton searches for, found at its trie state
+struct STATE_ATOM
+{
+	const YR_AC_MATCH *match;
+	BYTE bytes[YR_MAX_ATOM_LENGTH];
+	UINT32 length;	// Trie state depth
+};
+
+// Identifies an atom's match entry across the states it's copied to
+typedef std::tuple<const YR_STRING*, const BYTE*, UINT32> MATCH_KEY;
+static inline MATCH_KEY MatchKey(__in const YR_AC_MATCH *match) { return MATCH_KEY(match->string, match->forward_code, match->backtrack); }
+
+void RULE_COST::WeakAtomString(__out qstring &text) const
+{
+	text.clear();
+	if (minQuality == INT_MAX)
+		text = "-";
+	else
+	if (weakLength == 0)
+		text = "(none)";
+	else
+	{
+		for (UINT32 i = 0; i < weakLength; i++)
+			text.cat_sprnt((i ? " %02X" : "%02X"), weakAtom[i]);
+	}
+}
+
+// The libyara byte heuristic atom quality, for exact (unmasked) atoms.
+// Reimplemented since libyara doesn't export its atom scoring.
+static int HeuristicQuality(__in_bcount(length) const BYTE *atom, UINT32 length)
+{
+	BYTE seen[256] = { 0 };
+	int quality = 0, unique = 0;
+	for (UINT32 i = 0; i < length; i++)
+	{
+		switch (atom[i])
+		{
+			// Common bytes
+			case 0x00:
+			case 0x20:
+			case 0xCC:
+			case 0xFF:
+			quality += 12;
+			break;
+
+			default:
+			// Letters slightly less, they make more case combination atoms
+			quality += ((((atom[i] | 0x20) >= 'a') && ((atom[i] | 0x20) <= 'z')) ? 18 : 20);
+			break;
+		};
+		if (!seen[atom[i]])
+		{
+			seen[atom[i]] = TRUE;
+			unique++;
+		}
+	}
+
+	// All the same very common byte is penalized, else more unique bytes is better
+	if ((unique == 1) && (seen[0x00] || seen[0x20] || seen[0x90] || seen[0xCC] || seen[0xFF]))
+		quality -= (10 * (int) length);
+	else
+		quality += (2 * unique);
+	return (YR_MAX_ATOM_QUALITY - (22 * YR_MAX_ATOM_LENGTH) + quality);
+}
+
+// The libyara atom quality table lookup: the lowest quality of the table atoms starting with the atom, scaled down for
+// shorter atoms, the top quality if not in the table
+static int TableQuality(__in const std::vector<BYTE> &table, __in_bcount(length) const BYTE *atom, UINT32 length)
+{
+	const size_t entrySize = sizeof(YR_ATOM_QUALITY_TABLE_ENTRY);
+	size_t begin = 0, end = (table.size() / entrySize);
+	while (begin < end)
+	{
+		size_t middle = (begin + ((end - begin) / 2));
+		if (memcmp(&table[middle * entrySize], atom, length) < 0)
+			begin = (middle + 1);
+		else
+			end = middle;
+	}
+
+	// "begin" is the first table atom not less than the atom
+	int quality = INT_MAX;
+	for (size_t i = begin; ((i * entrySize) < table.size()) && (memcmp(&table[i * entrySize], atom, length) == 0); i++)
+		quality = min(quality, (int) table[(i * entrySize) + YR_MAX_ATOM_LENGTH]);
+	if (quality == INT_MAX)
+		return YR_MAX_ATOM_QUALITY;
+	return (quality >> (YR_MAX_ATOM_LENGTH - length));
+}
+
+static BOOL ReadAtomTable(__in LPCSTR path, __out std::vector<BYTE> &table)
+{
+	table.clear();
+	FILE *fp = NULL;
+	qwstring widePath;
+	utf8_utf16(&widePath, path);
+	if (_wfopen_s(&fp, widePath.c_str(), L"rbS") != 0)
+		return FALSE;
+	long size = ((fseek(fp, 0, SEEK_END) == 0) ? ftell(fp) : 0);
+	size -= (size % sizeof(YR_ATOM_QUALITY_TABLE_ENTRY));
+	if (size > 0)
+	{
+		table.resize((size_t) size);
+		fseek(fp, 0, SEEK_SET);
+		if (fread(table.data(), 1, table.size(), fp) != table.size())
+			table.clear();
+	}
+	fclose(fp);
+	return !table.empty();
+}
+
+// Walk the automaton trie (the goto transitions, not the failure links) collecting every atom match entry.
+// A state's match list also has copies of its failure states' (shorter suffix atom) matches, so an entry's atom is
+// the path to the shallowest state it's at.
+static void GetAtoms(__in YR_RULES *rules, __out qvector<STATE_ATOM> &atoms)
+{
+	const YR_AC_TRANSITION *transitions = rules->ac_transition_table;
+	qvector<STATE_ATOM> all;
+	std::map<MATCH_KEY, UINT32> depths;
+
+	struct NODE
+	{
+		UINT32 state;
+		BYTE bytes[YR_MAX_ATOM_LENGTH];
+		UINT32 depth;
+	};
+	qvector<NODE> stack;
+	stack.push_back({ YR_AC_ROOT_STATE, { 0 }, 0 });
+	while (!stack.empty())
+	{
+		NODE node = stack.back();
+		stack.pop_back();
+
+		if (UINT32 first = rules->ac_match_table[node.state])
+		{
+			for (const YR_AC_MATCH *match = &rules->ac_match_pool[first - 1]; match; match = match->next)
+			{
+				STATE_ATOM &atom = all.push_back();
+				atom.match = match;
+				memcpy(atom.bytes, node.bytes, sizeof(atom.bytes));
+				atom.length = node.depth;
+
+				auto it = depths.find(MatchKey(match));
+				if (it == depths.end())
+					depths[MatchKey(match)] = node.depth;
+				else
+					it->second = min(it->second, node.depth);
+			}
+		}
+
+		// Atoms are at most YR_MAX_ATOM_LENGTH deep
+		if (node.depth < YR_MAX_ATOM_LENGTH)
+		{
+			for (UINT32 index = 1; index <= 256; index++)
+			{
+				YR_AC_TRANSITION transition = transitions[node.state + index];
+				if (!YR_AC_INVALID_TRANSITION(transition, index))
+				{
+					NODE child = node;
+					child.state = (UINT32) YR_AC_NEXT_STATE(transition);
+					child.bytes[child.depth++] = (BYTE) (index - 1);
+					stack.push_back(child);
+				}
+			}
+		}
+	}
+
+	atoms.clear();
+	for (const STATE_ATOM &atom : all)
+	{
+		if (atom.length == depths[MatchKey(atom.match)])
+			atoms.push_back(atom);
+	}
+}
+
+// Add a compiled rules file's rules to the report
+static void AddRules(__in YR_RULES *rules, __in const RULE_WARNINGS &warnings, __in_opt const std::vector<BYTE> *table, __inout RULE_COSTS &report)
+{
+	size_t base = report.size();
+	std::map<std::string, size_t> byName;
+	YR_RULE *rule;
+	yr_rules_foreach(rules, rule)
+	{
+		RULE_COST &cost = report.push_back();
+		cost.rule = rule->identifier;
+		cost.ns = (rule->ns ? rule->ns->name : "");
+		cost.strings = cost.atoms = cost.noAtoms = cost.weakLength = 0;
+		cost.minQuality = INT_MAX;
+		memset(cost.weakAtom, 0, sizeof(cost.weakAtom));
+		YR_STRING *string;
+		yr_rule_strings_foreach(rule, string)
+			cost.strings++;
+		byName[rule->identifier] = (report.size() - 1);
+	}
+
+	qvector<STATE_ATOM> atoms;
+	GetAtoms(rules, atoms);
+	for (const STATE_ATOM &atom : atoms)
+	{
+		RULE_COST &cost = report[base + atom.match->string->rule_idx];
+		cost.atoms++;
+		int quality;
+		if (atom.length == 0)
+		{
+			cost.noAtoms++;
+			quality = YR_MIN_ATOM_QUALITY;
+		}
+		else
+			quality = (table ? TableQuality(*table, atom.bytes, atom.length) : HeuristicQuality(atom.bytes, atom.length));
+
+		if (quality < cost.minQuality)
+		{
+			cost.minQuality = quality;
+			memcpy(cost.weakAtom, atom.bytes, sizeof(cost.weakAtom));
+			cost.weakLength = atom.length;
+		}
+	}
+
+	for (const RULE_WARNING &warning : warnings)
+	{
+		auto it = (!warning.rule.empty() ? byName.find(warning.rule.c_str()) : byName.end());
+		if (it != byName.end())
+			report[it->second].warnings.push_back().sprnt("%d: %s", warning.line, warning.message.c_str());
+		else
+			msg(MSG_TAG "Compile warning, \"%s\" line %d: %s\n", warning.file.c_str(), warning.line, warning.message.c_str());
+	}
+}
+
+BOOL BuildRuleCostReport(__in const qstrvec_t &paths, __in_opt LPCSTR atomTable, __out RULE_COSTS &report)
+{
+	report.clear();
+	BOOL result = FALSE;
+	WaitBox::show("Yara for IDA", "Building rule cost report..", "url(" STYLE_PATH "progress-style.qss)", STYLE_PATH "icon.png");
+	WaitBox::updateAndCancelCheck(-1);
+
+	try
+	{
+		TIMESTAMP startTime = GetTimeStamp();
+		std::vector<BYTE> table;
+		BOOL useTable = (atomTable && atomTable[0]);
+		if (useTable && !ReadAtomTable(atomTable, table))
+		{
+			msg(MSG_TAG "** Failed to read the atom quality table \"%s\" **\n", atomTable);
+			goto exit;
+		}
+
+		for (const qstring &path : paths)
+		{
+			RULE_WARNINGS warnings;
+			YR_RULES *rules = CompileRulesUncached(path.c_str(), (useTable ? atomTable : NULL), &warnings);
+			if (!rules)
+				goto exit;
+			AddRules(rules, warnings, (useTable ? &table : NULL), report);
+			yr_rules_destroy(rules);
+			if (WaitBox::updateAndCancelCheck())
+			{
+				msg("- Rule cost report canceled -\n");
+				goto exit;
+			}
+		}
+
+		// Costliest first
+		std::stable_sort(report.begin(), report.end(), [](const RULE_COST &a, const RULE_COST &b)
+		{
+			if (a.noAtoms != b.noAtoms)
+				return (a.noAtoms > b.noAtoms);
+			if (a.minQuality != b.minQuality)
+				return (a.minQuality < b.minQuality);
+			if (a.warnings.size() != b.warnings.size())
+				return (a.warnings.size() > b.warnings.size());
+			return (a.atoms > b.atoms);
+		});
+
+		UINT32 noAtomRules = 0, warningRules = 0;
+		for (const RULE_COST &cost : report)
+		{
+			noAtomRules += (cost.noAtoms != 0);
+			warningRules += !cost.warnings.empty();
+		}
+		msg(MSG_TAG "Rule cost report: %u rules, %u with strings without an atom, %u with compile warnings, atom quality by %s, in %s\n",
+			(UINT32) report.size(), noAtomRules, warningRules, (useTable ? "table" : "the libyara heuristic"), TimeString(GetTimeStamp() - startTime));
+		result = TRUE;
+	}
+	CATCH()
+
+	exit:;
+	if (!result)
+		report.clear();
+	WaitBox::hide();
+	return result;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+static void PutCsvString(__in FILE *fp, __in LPCSTR text)
+{
+	fputc('"', fp);
+	for (; *text; text++)
+	{
+		if (*text == '"')
+			fputc('"', fp);
+		fputc(*text, fp);
+	}
+	fputc('"', fp);
+}
+
+static void PutJsonString(__in FILE *fp, __in LPCSTR text)
+{
+	fputc('"', fp);
+	for (; *text; text++)
+	{
+		BYTE c = (BYTE) *text;
+		if ((c == '"') || (c == '\\'))
+			fprintf(fp, "\\%c", c);
+		else
+		if (c < ' ')
+			fprintf(fp, "\\u%04X", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+BOOL ExportRuleCostReport(__in const RULE_COSTS &report, __in LPCSTR path)
+{
+	FILE *fp = NULL;
+	qwstring widePath;
+	utf8_utf16(&widePath, path);
+	errno_t err = _wfopen_s(&fp, widePath.c_str(), L"wbS");
+	if (err != 0)
+	{
+		char buffer[1024];
+		strerror_s(buffer, sizeof(buffer), err);
+		msg(MSG_TAG "** Failed to create \"%s\": \"%s\" **\n", path, buffer);
+		return FALSE;
+	}
+
+	LPCSTR extension = PathFindExtensionA(path);
+	BOOL csv = (_stricmp(extension, ".csv") == 0);
+	if (csv)
+		fputs("rank,rule,namespace,min_quality,weakest_atom,atoms,no_atom_strings,strings,warnings\r\n", fp);
+
+	qstring atom, warnings;
+	for (size_t i = 0; i < report.size(); i++)
+	{
+		const RULE_COST &cost = report[i];
+		cost.WeakAtomString(atom);
+		if (csv)
+		{
+			warnings.clear();
+			for (const qstring &warning : cost.warnings)
+			{
+				if (!warnings.empty())
+					warnings += " | ";
+				warnings += warning;
+			}
+
+			fprintf(fp, "%u,", (UINT32) (i + 1));
+			PutCsvString(fp, cost.rule.c_str());
+			fputc(',', fp);
+			PutCsvString(fp, cost.ns.c_str());
+			if (cost.minQuality != INT_MAX)
+				fprintf(fp, ",%d,", cost.minQuality);
+			else
+				fputs(",,", fp);
+			fprintf(fp, "%s,%u,%u,%u,", atom.c_str(), cost.atoms, cost.noAtoms, cost.strings);
+			PutCsvString(fp, warnings.c_str());
+			fputs("\r\n", fp);
+		}
+		else
+		{
+			fprintf(fp, "{\"rank\":%u,\"rule\":", (UINT32) (i + 1));
+			PutJsonString(fp, cost.rule.c_str());
+			fputs(",\"ns\":", fp);
+			PutJsonString(fp, cost.ns.c_str());
+			if (cost.minQuality != INT_MAX)
+				fprintf(fp, ",\"min_quality\":%d,\"weakest_atom\":\"%s\"", cost.minQuality, atom.c_str());
+			else
+				fputs(",\"min_quality\":null,\"weakest_atom\":null", fp);
+			fprintf(fp, ",\"atoms\":%u,\"no_atom_strings\":%u,\"strings\":%u,\"warnings\":[", cost.atoms, cost.noAtoms, cost.strings);
+			for (size_t j = 0; j < cost.warnings.size(); j++)
+			{
+				if (j)
+					fputc(',', fp);
+				PutJsonString(fp, cost.warnings[j].c_str());
+			}
+			fputs("]}\n", fp);
+		}
+	}
+
+	BOOL result = (ferror(fp) == 0);
+	if (fclose(fp) != 0)
+		result = FALSE;
+	if (result)
+		msg(MSG_TAG "Exported the rule cost report (%u rules) to \"%s\"\n", (UINT32) report.size(), path);
+	else
+		msg(MSG_TAG "** Failed to write \"%s\" **\n", path);
+	return result;
+}
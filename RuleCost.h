@@ -0,0 +1,41 @@
+
+// Compile time rule cost report
+#pragma once
+
+#include "stdafx.h"
+
+/*
+Ranks rules by how much scan work their atoms cause, so the few rules that dominate a set's scan time can be found
+and fixed before it ships.
+Each rules file is compiled fresh (bypassing the compiled cache, so the compile warnings are always seen) with the
+current atom quality setting. Its compiled Aho-Corasick automaton is then walked to find every atom the scanner
+searches for, as libyara actually chose them, and each is scored the way libyara scores atoms (by the atom quality
+table when one is set, else by its byte heuristic). A low quality atom is common in code and data, and each of its
+occurrences is a string verification. Worst of all are strings libyara found no atom for at all, since those get
+verified at every byte scanned.
+Rules are ranked by: strings without an atom, then lowest atom quality, then compile warnings, then atom count.
+*/
+
+struct RULE_COST
+{
+	qstring rule;
+	qstring ns;
+	UINT32 strings;
+	UINT32 atoms;
+	UINT32 noAtoms;		// Strings without an atom
+	int minQuality;		// Lowest atom quality, INT_MAX when the rule has no atoms
+	BYTE weakAtom[YR_MAX_ATOM_LENGTH]; // The lowest quality atom
+	UINT32 weakLength;
+	qstrvec_t warnings;	// Compile warnings, "line: message"
+
+	// The lowest quality atom as hex bytes, "-" for none
+	void WeakAtomString(__out qstring &text) const;
+};
+typedef qvector<RULE_COST> RULE_COSTS;
+
+// Compile the rules files (UTF-8 paths) with the optional atom quality table and rank their rules by cost, highest
+// cost first. Shows a cancelable wait box, returns FALSE if canceled or on a compile failure with the reason logged.
+BOOL BuildRuleCostReport(__in const qstrvec_t &paths, __in_opt LPCSTR atomTable, __out RULE_COSTS &report);
+
+// Save the report in the ranked order: ".csv" by the file extension, else JSON Lines. Returns TRUE on success.
+BOOL ExportRuleCostReport(__in const RULE_COSTS &report, __in LPCSTR path);
@@ -0,0 +1,66 @@
+
+// Rule image file format, shared with the RuleImageBuilder build tool
+#pragma once
+
+#include "Hash.h"
+
+/*
+A rule image is a rules file precompiled into "<rules file name>.yarc" next to it, see CompiledCache.h.
+ Header: signature, image version, YR_ARENA_FILE_VERSION, rules file content hash, module count, then per module a
+ UINT32 length and the name of a module the rules import. The rest is the libyara rules arena stream.
+The plugin ("Build rule images" command) and the RuleImageBuilder tool (run by the plugin build for the signsrch
+sets) both write them through here, so they make the same file.
+*/
+
+#define RULE_IMAGE_NAMESPACE "rule_image"	// The namespace rule images are compiled into
+#define RULE_IMAGE_SIGNATURE 0x49523459		// "Y4RI"
+#define RULE_IMAGE_VERSION   1
+#define RULE_IMAGE_EXTENSION L".yarc"
+
+// Content hash of a rules file
+static inline UINT64 HashRuleText(__in_bcount(size) LPCVOID data, size_t size)
+{
+	UINT64 hash = FNV64_BASIS;
+	hash = fnv64(hash, &size, sizeof(size));
+	return fnv64(hash, data, size);
+}
+
+// Get the module name of an 'import "name"' rules file line, returns FALSE for any other line
+static inline BOOL GetImportName(__in LPCSTR line, __out_bcount(size) LPSTR name, size_t size)
+{
+	while (isspace((BYTE) *line))
+		line++;
+	if (strncmp(line, "import", (sizeof("import") - 1)) != 0)
+		return FALSE;
+
+	LPCSTR open = strchr(line, '"');
+	LPCSTR close = strrchr(line, '"');
+	if (!open || (close <= (open + 1)))
+		return FALSE;
+	size_t length = (size_t) (close - (open + 1));
+	if (length >= size)
+		return FALSE;
+	memcpy(name, (open + 1), length);
+	name[length] = 0;
+	return TRUE;
+}
+
+// Write the rule image header, the rules arena stream follows it
+static inline BOOL WriteRuleImageHeader(__in FILE *fp, UINT64 hash, __in_ecount(count) const LPCSTR *modules, UINT32 count)
+{
+	UINT32 value = RULE_IMAGE_SIGNATURE;
+	fwrite(&value, sizeof(value), 1, fp);
+	value = RULE_IMAGE_VERSION;
+	fwrite(&value, sizeof(value), 1, fp);
+	value = YR_ARENA_FILE_VERSION;
+	fwrite(&value, sizeof(value), 1, fp);
+	fwrite(&hash, sizeof(hash), 1, fp);
+	fwrite(&count, sizeof(count), 1, fp);
+	for (UINT32 i = 0; i < count; i++)
+	{
+		value = (UINT32) strlen(modules[i]);
+		fwrite(&value, sizeof(value), 1, fp);
+		fwrite(modules[i], value, 1, fp);
+	}
+	return (ferror(fp) == 0);
+}
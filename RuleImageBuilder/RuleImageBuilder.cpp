@@ -0,0 +1,220 @@
+
+// Rule image build tool
+// Precompiles self contained rules files into rule images ("<rules file name>.yarc") next to them, the same as the
+// plugin's "Build rule images" command. Run by the plugin build for the shipped signsrch rule sets.
+// Usage: RuleImageBuilder <rules file> [<rules file> ..]
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <Shlwapi.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+#pragma comment(lib, "Shlwapi.lib")
+#ifndef _DEBUG
+#pragma comment(lib, "../libyara/Release/libyara64.lib")
+#else
+#pragma comment(lib, "../libyara/Debug/libyara64.lib")
+#endif
+
+#include "yara.h"
+#include "..\RuleImage.h"
+
+#define TOOL_TAG "RuleImageBuilder"
+
+// Stream adaptor for yr_rules_save_stream()
+static size_t StreamWrite(__in_bcount(size * count) const void *ptr, size_t size, size_t count, __in void *user_data)
+{
+	return fwrite(ptr, size, count, (FILE*) user_data);
+}
+
+// Compile errors and warnings, in the "file(line): error: text" form Visual Studio lists
+static void CompilerStatusCallback(int error_level, __in_opt const char *file_name, int line_number, __in_opt const YR_RULE *rule, __in const char *message, __in void *user_data)
+{
+	fprintf(stderr, "%s(%d): %s: %s\n", (file_name ? file_name : TOOL_TAG), line_number, ((error_level == YARA_ERROR_LEVEL_ERROR) ? "error" : "warning"), message);
+}
+
+// Rule images are for self contained rules files, fail any include
+static const char *CompilerIncludesCallback(__in const char *include_name, __in_opt const char *calling_rule_filename, __in_opt const char *calling_rule_namespace, __in void *user_data)
+{
+	fprintf(stderr, "%s: error: includes \"%s\", rule images are for self contained rules files\n", (LPCSTR) user_data, include_name);
+	return NULL;
+}
+//
+static void CompilerIncludesFree(__in const char *callback_result_ptr, __in void *user_data)
+{
+}
+
+// Read a whole file, returns FALSE on failure
+static BOOL ReadFileData(__in LPCWSTR path, __out std::vector<BYTE> &data)
+{
+	BOOL success = FALSE;
+	FILE *fp = NULL;
+	if (_wfopen_s(&fp, path, L"rbS") != 0)
+		return FALSE;
+
+	if (_fseeki64(fp, 0, SEEK_END) == 0)
+	{
+		__int64 fileSize = _ftelli64(fp);
+		if ((fileSize >= 0) && (_fseeki64(fp, 0, SEEK_SET) == 0))
+		{
+			data.resize((size_t) fileSize);
+			success = ((fileSize == 0) || (fread(data.data(), data.size(), 1, fp) == 1));
+		}
+	}
+	fclose(fp);
+	return success;
+}
+
+// The modules a rules file imports, from its 'import "name"' lines, in file order
+static void GetImports(__in LPCWSTR path, __out std::vector<std::string> &modules)
+{
+	modules.clear();
+	FILE *fp = NULL;
+	if (_wfopen_s(&fp, path, L"rtS") != 0)
+		return;
+
+	char line[1024], name[128];
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (GetImportName(line, name, sizeof(name)) && (std::find(modules.begin(), modules.end(), name) == modules.end()))
+			modules.push_back(name);
+	}
+	fclose(fp);
+}
+
+// Compile a rules file into RULE_IMAGE_NAMESPACE and save its rule image, returns TRUE on success
+static BOOL BuildRuleImage(__in LPCWSTR path)
+{
+	BOOL success = FALSE;
+	YR_COMPILER *compiler = NULL;
+	YR_RULES *rules = NULL;
+	FILE *fp = NULL;
+	WCHAR imagePath[MAX_PATH], tempPath[MAX_PATH];
+	tempPath[0] = 0;
+
+	// UTF-8 name for the messages, like the plugin's
+	char name[MAX_PATH];
+	WideCharToMultiByte(CP_UTF8, 0, path, -1, name, sizeof(name), NULL, NULL);
+
+	try
+	{
+		// The image has the hash of the rules file as it's compiled
+		std::vector<BYTE> text;
+		if (!ReadFileData(path, text))
+		{
+			fprintf(stderr, "%s: error: failed to read the rules file\n", name);
+			goto exit;
+		}
+		UINT64 hash = HashRuleText(text.data(), text.size());
+
+		int yaraResult = yr_compiler_create(&compiler);
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			fprintf(stderr, TOOL_TAG ": error: yr_compiler_create() failed with error %d\n", yaraResult);
+			goto exit;
+		}
+		yr_compiler_set_callback(compiler, CompilerStatusCallback, NULL);
+		yr_compiler_set_include_callback(compiler, CompilerIncludesCallback, CompilerIncludesFree, name);
+
+		if (_wfopen_s(&fp, path, L"rbS") != 0)
+		{
+			fprintf(stderr, "%s: error: failed to open the rules file\n", name);
+			goto exit;
+		}
+		if (yr_compiler_add_file(compiler, fp, RULE_IMAGE_NAMESPACE, name) != 0)
+			goto exit;
+		fclose(fp);
+		fp = NULL;
+
+		yaraResult = yr_compiler_get_rules(compiler, &rules);
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			fprintf(stderr, "%s: error: yr_compiler_get_rules() failed with error %d\n", name, yaraResult);
+			goto exit;
+		}
+
+		// Write to a temporary file first, so a failed build never leaves a partial image
+		wcsncpy_s(imagePath, _countof(imagePath), path, _TRUNCATE);
+		PathRenameExtensionW(imagePath, RULE_IMAGE_EXTENSION);
+		swprintf_s(tempPath, _countof(tempPath), L"%s.tmp", imagePath);
+		if (_wfopen_s(&fp, tempPath, L"wbS") != 0)
+		{
+			fprintf(stderr, "%s: error: failed to create the rule image\n", name);
+			tempPath[0] = 0;
+			goto exit;
+		}
+
+		{
+			std::vector<std::string> modules;
+			GetImports(path, modules);
+			std::vector<LPCSTR> names;
+			for (const std::string &module : modules)
+				names.push_back(module.c_str());
+			WriteRuleImageHeader(fp, hash, names.data(), (UINT32) names.size());
+		}
+
+		YR_STREAM stream = { fp, NULL, StreamWrite };
+		yaraResult = yr_rules_save_stream(rules, &stream);
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			fprintf(stderr, "%s: error: yr_rules_save_stream() failed with error %d\n", name, yaraResult);
+			goto exit;
+		}
+
+		success = (ferror(fp) == 0);
+		fclose(fp);
+		fp = NULL;
+		if (success)
+			success = MoveFileExW(tempPath, imagePath, MOVEFILE_REPLACE_EXISTING);
+		if (success)
+			printf("\"%s\": %u rules, rule image saved\n", PathFindFileNameA(name), rules->num_rules);
+		else
+			fprintf(stderr, "%s: error: failed to write the rule image\n", name);
+	}
+	catch (...)
+	{
+		fprintf(stderr, "%s: error: exception while building the rule image\n", name);
+	}
+
+	exit:;
+	if (fp)
+		fclose(fp);
+	if (!success && tempPath[0])
+		DeleteFileW(tempPath);
+	if (rules)
+		yr_rules_destroy(rules);
+	if (compiler)
+		yr_compiler_destroy(compiler);
+	return success;
+}
+
+int wmain(int argc, __in_ecount(argc) WCHAR *argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: " TOOL_TAG " <rules file> [<rules file> ..]\n");
+		return EXIT_FAILURE;
+	}
+
+	int yaraResult = yr_initialize();
+	if (yaraResult != ERROR_SUCCESS)
+	{
+		fprintf(stderr, TOOL_TAG ": error: yr_initialize() failed with error %d\n", yaraResult);
+		return EXIT_FAILURE;
+	}
+
+	// Any failure fails the build, rather than shipping a stale image
+	int result = EXIT_SUCCESS;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!BuildRuleImage(argv[i]))
+			result = EXIT_FAILURE;
+	}
+
+	yr_finalize();
+	return result;
+}
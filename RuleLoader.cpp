@@ -0,0 +1,936 @@
+
+// Resident compiled rules
+#include "stdafx.h"
+#include "RuleLoader.h"
+#include "CompiledCache.h"
+#include "IncludeCache.h"
+#include "ConcurrentCallbacks.h"
+#include <list>
+#include <set>
+
+extern BOOL optionVerbose, optionSingleThread;
+extern LPCSTR YaraStatusString(int error);
+
+#define MAX_INDEX_DEPTH 8
+#define ATOM_QUALITY_WARNING 128	// Table atom quality below this gets the slow rule warning, about once per 64KB of code/data
+
+static qstring atomTablePath;	// Atom quality table file, empty for the libyara heuristic
+
+// A compile unit; a rules file, or one of the files an index rules file includes
+struct RULE_UNIT
+{
+	qstring path;
+	qstring ns;		// Namespace, the selected rules file it came from
+};
+typedef qvector<RULE_UNIT> RULE_UNITS;
+
+// A compile unit's rule set and what it was built from
+struct RULE_SET
+{
+	qstring path;				// Unit rules file
+	qstring ns;					// Rule image loaded rules use it for their namespace name
+	YR_RULES *rules;			// NULL if the load failed
+	RULE_SOURCES sources;		// Unit rules file first, then its includes
+	qstrvec_t messages;			// Load output, queued for the IDA thread
+	BOOL cached;				// Came from the compiled cache
+	BOOL image;					// Came from the rules file's rule image
+	qstring atomTable;			// Atom quality table compiled with, empty for none
+	char basePath[MAX_PATH];	// For relative includes, same as a whole compile of the selected file
+
+	RULE_SET(__in const RULE_UNIT &unit) : path(unit.path), ns(unit.ns), rules(NULL), cached(FALSE), image(FALSE), atomTable(atomTablePath)
+	{
+		strncpy_s(basePath, sizeof(basePath), unit.ns.c_str(), SIZESTR(basePath) - 1);
+		if (LPSTR filename = PathFindFileNameA(basePath))
+			*filename = 0;
+	}
+	~RULE_SET()
+	{
+		if (rules)
+			yr_rules_destroy(rules);
+	}
+	RULE_SET(const RULE_SET&) = delete;
+	RULE_SET& operator=(const RULE_SET&) = delete;
+};
+
+static int yaraInitalized = -1;
+static std::list<RULE_SET> residentSets;	// In no particular order
+static qstrvec_t wholeFiles;	// Index files whose units didn't compile separately, for the session
+static IncludeCache includeCache; // Session cache of the include files, shared by the concurrent compiles
+
+// Background compile started at plugin load
+static struct
+{
+	HANDLE thread;			// Set until joined
+	std::list<RULE_SET> sets;
+	TIMESTAMP startTime;
+} precompile;
+static __declspec(thread) qstrvec_t *queuedMessages = NULL; // Set on rule load worker threads
+static __declspec(thread) RULE_WARNINGS *queuedWarnings = NULL; // Set while CompileRulesUncached() collects the warnings
+
+void RuleMsg(__in LPCSTR format, ...)
+{
+	va_list va;
+	va_start(va, format);
+	if (queuedMessages)
+		queuedMessages->push_back().vsprnt(format, va);
+	else
+		vmsg(format, va);
+	va_end(va);
+}
+
+// YARA compile warnings and error callback
+static void YaraCompilerStatusCallback(int error_level, __in const char *file_name, int line_number, __in const YR_RULE *rule, __in const char *message, __in void *user_data)
+{
+	try
+	{
+		switch (error_level)
+		{
+			case YARA_ERROR_LEVEL_ERROR:
+			{
+				// On return from this error, the compiler will abort
+				RuleMsg("\n ** Rule compile ERROR: **\n");
+				*((LPBOOL) user_data) = TRUE;
+			}
+			break;
+
+			case YARA_ERROR_LEVEL_WARNING:
+			{
+				if (queuedWarnings)
+				{
+					RULE_WARNING &warning = queuedWarnings->push_back();
+					if (rule && rule->identifier)
+						warning.rule = rule->identifier;
+					warning.file = (file_name ? file_name : "");
+					warning.line = line_number;
+					warning.message = message;
+				}
+				if (!optionVerbose)
+					return;
+
+				RuleMsg("\n Rule compile WARNING:\n");
+			}
+			break;
+		};
+
+		RuleMsg(" File: \"%s\", line: %d\n", file_name, line_number);
+		if (rule && rule->metas && rule->metas->identifier)
+			RuleMsg(" Desc: \"%s\"\n", rule->metas->identifier);
+		RuleMsg(" Reason: \"%s\"\n", message);
+
+		// Only on the IDA thread, the worker threads queue their messages
+		if (!queuedMessages)
+			REFRESH_UI();
+	}
+	catch (std::exception &ex)
+	{
+		RuleMsg("** STD C++ exception!: What: \"%s\", Function: \"%s\" **\n", ex.what(), __FUNCTION__);
+		*((LPBOOL) user_data) = TRUE;
+	} 
+	catch (...)
+	{
+		RuleMsg("** C/C++ exception! Function: \"%s\" **\n", __FUNCTION__); 
+		*((LPBOOL) user_data) = TRUE;
+	}
+}
+
+// YARA compile include file callback
+static const char* YaraCompilerIncludesCallback(__in const char *include_name, __in const char *calling_rule_filename, __in const char *calling_rule_namespace, __in void *user_data)
+{
+	// Need this for two reasons: 
+	//  1) To resolve relative paths for "include" directive files.
+	//  2) Verbose log/msg output for showing the inclusion of "include" directive files.
+	RULE_SET *set = (RULE_SET*) user_data;
+	try
+	{
+		if (optionVerbose)
+			//RuleMsg(" Include: \"%s\", Calling rule: \"%s\", \"%s\"\n", include_name, calling_rule_filename, calling_rule_namespace);
+			RuleMsg(" Include: Path: \"%s\", Calling rule: \"%s\"\n", include_name, calling_rule_filename);
+
+		// Convert the usual relative to absolute path as needed
+		char fixedPath[MAX_PATH];
+		if (PathIsRelativeA(include_name))
+		{
+			// Combine with base path derived from the set's root input file
+			char combinedPath[MAX_PATH] = { 0 };
+			if (!PathCombineA(combinedPath, set->basePath, include_name))
+			{
+				RuleMsg("YaraCompilerIncludesCallback: ** Failed to combine paths! **\n");
+				return NULL;
+			}
+
+			// Clean up combined path
+			GetFullPathNameA(combinedPath, sizeof(fixedPath), fixedPath, NULL);
+			include_name = fixedPath;
+		}
+
+		// The text comes from the include cache, only read if it's new or changed
+		UINT64 hash = 0;
+		LPCSTR text = includeCache.Get(include_name, hash);
+
+		// Track it as a compiled rules cache source
+		if (text)
+			AddRuleSource(set->sources, include_name, hash);
+		return text;
+	}
+	CATCH()
+	return NULL;
+}
+//
+static void YaraCompilerIncludesFree(__in const char *callback_result_ptr, __in void *user_data)
+{
+	// Owned by the include cache
+}
+
+// Content hash of a rules file through the include cache
+static BOOL CachedHashRuleFile(__in LPCSTR path, __out UINT64 &hash)
+{
+	return (includeCache.Get(path, hash) != NULL);
+}
+
+// Compile a rules file from source in its own compiler, then destroy the compiler
+static void CompileRules(__inout RULE_SET &set)
+{
+	YR_COMPILER *compiler = NULL;
+	BOOL compileError = FALSE, rootHashed = FALSE;
+	FILE *fp = NULL;
+	LPCSTR rootPath = set.path.c_str();
+	set.sources.clear();
+
+	try
+	{
+		int yaraResult = yr_compiler_create(&compiler);
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			RuleMsg(MSG_TAG "** YARA yr_compiler_create() failed with: %s **\n", YaraStatusString(yaraResult));
+			goto exit;
+		}
+		yr_compiler_set_callback(compiler, YaraCompilerStatusCallback, &compileError);
+		yr_compiler_set_include_callback(compiler, YaraCompilerIncludesCallback, YaraCompilerIncludesFree, &set);
+
+		// Hash the root file up front; if it changes during the compile the sources check just fails next time
+		UINT64 rootHash = 0;
+		rootHashed = CachedHashRuleFile(rootPath, rootHash);
+		if (rootHashed)
+			AddRuleSource(set.sources, rootPath, rootHash);
+
+		// Optional atom quality table, tracked as a source so the compiled rules follow its changes
+		if (!set.atomTable.empty())
+		{
+			UINT64 tableHash = 0, tableSize = 0;
+			LPCSTR table = includeCache.Get(set.atomTable.c_str(), tableHash, &tableSize);
+			int entries = (int) (tableSize / sizeof(YR_ATOM_QUALITY_TABLE_ENTRY));
+			if (!table || (entries == 0))
+			{
+				RuleMsg(MSG_TAG "** Failed to read the atom quality table \"%s\" **\n", set.atomTable.c_str());
+				goto exit;
+			}
+			// The include cache keeps the table data valid for the life of the compiler
+			yr_compiler_set_atom_quality_table(compiler, table, entries, ATOM_QUALITY_WARNING);
+			AddRuleSource(set.sources, set.atomTable.c_str(), tableHash);
+		}
+
+		// Open rules file
+		qwstring widePath;
+		utf8_utf16(&widePath, rootPath);
+		errno_t err = _wfopen_s(&fp, widePath.c_str(), L"rbS");
+		if (err != 0)
+		{
+			char buffer[1024];
+			strerror_s(buffer, sizeof(buffer), err);
+			RuleMsg(MSG_TAG "** Rules open failed with: \"%s\" **\n", buffer);
+			goto exit;
+		}
+
+		// Compile rules from rules file by handle
+		yaraResult = yr_compiler_add_file(compiler, fp, set.ns.c_str(), rootPath);
+		if (compileError)
+		{
+			// If compile error, bail out here since the yaraResult usually doesn't match the error				
+			goto exit;
+		}
+		else
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			RuleMsg(MSG_TAG "** YARA yr_compiler_add_file() failed with: %s **\n", YaraStatusString(yaraResult));
+			goto exit;
+		}
+
+		// Get a rule set ref from the compiler instance
+		yaraResult = yr_compiler_get_rules(compiler, &set.rules);
+		if (yaraResult != ERROR_SUCCESS)
+		{
+			RuleMsg(MSG_TAG "** YARA yr_compiler_get_rules() failed with: %s **\n", YaraStatusString(yaraResult));
+			set.rules = NULL;
+			goto exit;
+		}
+	}
+	CATCH()
+
+	exit:;
+	if (fp)
+		fclose(fp);
+	// The rules hold their own arena reference, the compiler's memory isn't needed after this
+	if (compiler)
+		yr_compiler_destroy(compiler);
+	if (!set.rules || !rootHashed)
+		set.sources.clear();
+}
+
+// Load the rules from the rules file's rule image or the compiled cache, else compile and cache them.
+// Runs on the IDA, precompile, or a pool thread.
+static void LoadRules(__inout RULE_SET &set)
+{
+	char numBuff[32];
+	TIMESTAMP startTime = GetTimeStamp();
+	LPCSTR name = PathFindFileNameA(set.path.c_str());
+
+	// Compiles with an atom quality table are cached separately, keyed by its contents
+	UINT64 options = 0;
+	if (!set.atomTable.empty() && !includeCache.Get(set.atomTable.c_str(), options))
+	{
+		RuleMsg(MSG_TAG "** Failed to read the atom quality table \"%s\" **\n", set.atomTable.c_str());
+		return;
+	}
+
+	// A rule image next to the rules file, only built with the default compiler settings
+	if (!options && LoadRuleImage(set.path.c_str(), &set.rules, set.sources, CachedHashRuleFile))
+	{
+		set.image = TRUE;
+		RuleMsg("\"%s\": %s rules loaded from the rule image in %s\n", name, NumberCommaString(set.rules->num_rules, numBuff), TimeString(GetTimeStamp() - startTime));
+		return;
+	}
+
+	// Use the cached compile if the rules and their includes haven't changed
+	if (LoadCompiledRules(set.path.c_str(), set.ns.c_str(), options, &set.rules, &set.sources, CachedHashRuleFile))
+	{
+		set.cached = TRUE;
+		if (optionVerbose)
+			RuleMsg("\"%s\": %s rules loaded from the compiled cache in %s\n", name, NumberCommaString(set.rules->num_rules, numBuff), TimeString(GetTimeStamp() - startTime));
+		return;
+	}
+
+	CompileRules(set);
+	if (!set.rules)
+		return;
+	RuleMsg("\"%s\": %s rules compiled in %s\n", name, NumberCommaString(set.rules->num_rules, numBuff), TimeString(GetTimeStamp() - startTime));
+
+	if (set.sources.empty())
+	{
+		// Couldn't hash the root file, can't tell when it changes so don't keep it around
+		yr_rules_destroy(set.rules);
+		set.rules = NULL;
+		RuleMsg(MSG_TAG "** Failed to read the rules file **\n");
+		return;
+	}
+
+	// Cache the compile for the next session
+	if (set.rules->num_rules > 0)
+	{
+		TIMESTAMP saveTime = GetTimeStamp();
+		if (SaveCompiledRules(set.sources, set.ns.c_str(), options, set.rules) && optionVerbose)
+			RuleMsg(" Compiled rules cached (%u source files) in %s\n", (UINT32) set.sources.size(), TimeString(GetTimeStamp() - saveTime));
+	}
+}
+
+// Pool worker for the concurrent rule set loads
+static BOOL WINAPI LoadRulesWorker(__in PVOID lParm)
+{
+	RULE_SET &set = *((RULE_SET*) lParm);
+	queuedMessages = &set.messages;
+	try
+	{
+		LoadRules(set);
+	}
+	CATCH()
+	queuedMessages = NULL;
+	return FALSE; // Failures are reported in the set's messages
+}
+
+// Returns TRUE if all the sources still have the same contents. Through the include cache, unchanged files aren't read again.
+static BOOL SourcesCurrent(__in const RULE_SOURCES &sources)
+{
+	for (const RULE_SOURCE &source : sources)
+	{
+		UINT64 hash = 0;
+		if (!includeCache.Get(source.path.c_str(), hash) || (hash != source.hash))
+			return FALSE;
+	}
+	return !sources.empty();
+}
+
+static BOOL InitYara()
+{
+	if (yaraInitalized != ERROR_SUCCESS)
+	{
+		yaraInitalized = yr_initialize();
+		if (yaraInitalized != ERROR_SUCCESS)
+		{
+			msg(MSG_TAG "** YARA yr_initialize() failed with: %s **\n", YaraStatusString(yaraInitalized));
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// If a rules file is only include directives (and comments), get the files it includes.
+// Relative includes resolve against the selected file's folder, same as YaraCompilerIncludesCallback().
+static BOOL ReadIndexFile(__in LPCSTR path, __in LPCSTR folder, __out qstrvec_t &includes)
+{
+	includes.clear();
+	UINT64 hash;
+	LPCSTR text = includeCache.Get(path, hash);
+	if (!text)
+		return FALSE;
+
+	BOOL inComment = FALSE;
+	for (LPCSTR line = text; *line;)
+	{
+		LPCSTR end = strchr(line, '\n');
+		if (!end)
+			end = (line + strlen(line));
+		qstring ln(line, (end - line));
+		ln.trim2();
+		line = (*end ? (end + 1) : end);
+
+		// Only whole line comments
+		if (inComment)
+		{
+			if (ln.find("*/") == qstring::npos)
+				continue;
+			if (!ln.ends_with("*/"))
+				return FALSE;
+			inComment = FALSE;
+			continue;
+		}
+		if (ln.empty() || ln.starts_with("//"))
+			continue;
+		if (ln.starts_with("/*"))
+		{
+			if (!ln.ends_with("*/") || (ln.length() < 4))
+				inComment = TRUE;
+			continue;
+		}
+
+		// include "path"
+		if (!ln.starts_with("include") || (ln.length() < 10))
+			return FALSE;
+		size_t open = ln.find('"'), close = ln.rfind('"');
+		if ((open == qstring::npos) || (close <= open) || (close != (ln.length() - 1)))
+			return FALSE;
+		qstring name = ln.substr(open + 1, close);
+		char fixedPath[MAX_PATH];
+		if (PathIsRelativeA(name.c_str()))
+		{
+			char combinedPath[MAX_PATH] = { 0 };
+			if (!PathCombineA(combinedPath, folder, name.c_str()))
+				return FALSE;
+			GetFullPathNameA(combinedPath, sizeof(fixedPath), fixedPath, NULL);
+		}
+		else
+			strncpy_s(fixedPath, sizeof(fixedPath), name.c_str(), SIZESTR(fixedPath));
+		includes.push_back(fixedPath);
+	}
+	return !includes.empty();
+}
+
+static void AddUnits(__in LPCSTR path, __in LPCSTR ns, __in LPCSTR folder, int depth, __inout RULE_UNITS &units)
+{
+	qstrvec_t includes;
+	if ((depth < MAX_INDEX_DEPTH) && ReadIndexFile(path, folder, includes))
+	{
+		for (const qstring &include : includes)
+			AddUnits(include.c_str(), ns, folder, (depth + 1), units);
+	}
+	else
+	{
+		RULE_UNIT &unit = units.push_back();
+		unit.path = path;
+		unit.ns = ns;
+	}
+}
+
+// The compile units of the selected rules files. Index files are split into their includes, so editing one file of a
+// large rule tree only recompiles that file. The rules keep the selected file's namespace either way.
+static void GetUnits(__in const qstrvec_t &paths, __out RULE_UNITS &units)
+{
+	units.clear();
+	for (const qstring &path : paths)
+	{
+		BOOL whole = FALSE;
+		for (const qstring &file : wholeFiles)
+			whole |= (_stricmp(file.c_str(), path.c_str()) == 0);
+		if (whole)
+		{
+			RULE_UNIT &unit = units.push_back();
+			unit.path = unit.ns = path;
+			continue;
+		}
+
+		char folder[MAX_PATH];
+		strncpy_s(folder, sizeof(folder), path.c_str(), SIZESTR(folder) - 1);
+		if (LPSTR filename = PathFindFileNameA(folder))
+			*filename = 0;
+		AddUnits(path.c_str(), path.c_str(), folder, 0, units);
+	}
+}
+
+static BOOL SameUnit(__in const RULE_SET &set, __in const RULE_UNIT &unit)
+{
+	return ((_stricmp(set.atomTable.c_str(), atomTablePath.c_str()) == 0) && (_stricmp(set.path.c_str(), unit.path.c_str()) == 0) && (_stricmp(set.ns.c_str(), unit.ns.c_str()) == 0));
+}
+
+static BOOL Wanted(__in const RULE_UNITS &units, __in const RULE_SET &set)
+{
+	for (const RULE_UNIT &unit : units)
+	{
+		if (SameUnit(set, unit))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void DumpMessages(__inout RULE_SET &set)
+{
+	for (const qstring &text : set.messages)
+		msg("%s", text.c_str());
+	set.messages.clear();
+}
+
+static DWORD WINAPI PrecompileThread(LPVOID lpParameter)
+{
+	try
+	{
+		for (RULE_SET &set : precompile.sets)
+		{
+			queuedMessages = &set.messages;
+			LoadRules(set);
+			queuedMessages = NULL;
+		}
+	}
+	CATCH()
+	queuedMessages = NULL;
+	return 0;
+}
+
+void PrecompileRules(__in const qstrvec_t &paths)
+{
+	try
+	{
+		if (precompile.thread || !residentSets.empty() || paths.empty() || !InitYara())
+			return;
+
+		RULE_UNITS units;
+		GetUnits(paths, units);
+		precompile.sets.clear();
+		for (const RULE_UNIT &unit : units)
+			precompile.sets.emplace_back(unit);
+
+		precompile.startTime = GetTimeStamp();
+		precompile.thread = CreateThread(NULL, 0, PrecompileThread, NULL, 0, NULL);
+		if (precompile.thread)
+			SetThreadPriority(precompile.thread, THREAD_PRIORITY_BELOW_NORMAL);
+		else
+			precompile.sets.clear();
+	}
+	CATCH()
+}
+
+// Wait for the precompile thread if it's running, and make its loaded sets resident if they're wanted.
+// The failed ones are left for GetRules() to redo and report.
+static void JoinPrecompile(__in_opt const RULE_UNITS *units)
+{
+	if (!precompile.thread)
+		return;
+
+	BOOL wanted = FALSE;
+	if (units)
+	{
+		for (RULE_SET &set : precompile.sets)
+			wanted |= Wanted(*units, set);
+	}
+	if (WaitForSingleObject(precompile.thread, 0) == WAIT_TIMEOUT)
+	{
+		if (wanted)
+			msg("Waiting on the background rules compile..\n");
+		WaitForSingleObject(precompile.thread, INFINITE);
+	}
+	CloseHandle(precompile.thread);
+	precompile.thread = NULL;
+
+	if (wanted)
+	{
+		UINT32 count = 0;
+		for (auto it = precompile.sets.begin(); it != precompile.sets.end();)
+		{
+			if (it->rules && Wanted(*units, *it))
+			{
+				DumpMessages(*it);
+				residentSets.splice(residentSets.end(), precompile.sets, it++);
+				count++;
+			}
+			else
+				++it;
+		}
+		if (count)
+			msg(" (%u rule unit(s) loaded in the background, started %s ago)\n", count, TimeString(GetTimeStamp() - precompile.startTime));
+	}
+	precompile.sets.clear();
+}
+
+// Load rule sets, concurrently when there's more than one. Their output is left queued.
+static void LoadSets(__inout std::list<RULE_SET> &sets)
+{
+	if (sets.size() == 1)
+	{
+		LoadRulesWorker(&sets.front());
+		return;
+	}
+
+	HRESULT hr = E_FAIL;
+	ConcurrentCallbackGroup *ccg = new ConcurrentCallbackGroup(hr, (optionSingleThread ? 1 : 0));
+	if (hr == ERROR_SUCCESS)
+	{
+		for (RULE_SET &set : sets)
+		{
+			hr = ccg->Add(LoadRulesWorker, &set);
+			if (hr != ERROR_SUCCESS)
+				break;
+		}
+	}
+	if (hr == ERROR_SUCCESS)
+	{
+		long errorCount = 0;
+		ccg->Start();
+		ccg->Wait(errorCount);
+	}
+	else
+	{
+		char buffer[1024];
+		msg(MSG_TAG "** ConcurrentCallbackGroup() failed! Reason: \"%s\" **\n", GetErrorString(hr, buffer));
+	}
+	delete ccg;
+}
+
+// Add the rule identifiers of a namespace's sets, returns TRUE on one already added
+static BOOL AddIdentifiers(__in LPCSTR ns, __in const std::list<RULE_SET> &sets, __inout std::set<qstring> &identifiers)
+{
+	for (const RULE_SET &set : sets)
+	{
+		if (set.rules && (_stricmp(set.ns.c_str(), ns) == 0))
+		{
+			YR_RULE *rule;
+			yr_rules_foreach(set.rules, rule)
+			{
+				if (!identifiers.insert(rule->identifier).second)
+				{
+					msg(" Rule \"%s\" is in more than one file of \"%s\"\n", rule->identifier, PathFindFileNameA(ns));
+					return TRUE;
+				}
+			}
+		}
+	}
+	return FALSE;
+}
+
+// Returns TRUE if a rule identifier is in more than one of the namespace's units. Compiled separately their compilers
+// can't see each other's rules, so the duplicate error a whole compile gives has to be checked for here.
+static BOOL DuplicateIdentifiers(__in LPCSTR ns, __in const std::list<RULE_SET> &loading)
+{
+	std::set<qstring> identifiers;
+	return (AddIdentifiers(ns, residentSets, identifiers) || AddIdentifiers(ns, loading, identifiers));
+}
+
+BOOL GetRules(__in const qstrvec_t &paths, __out RULE_SETS &rules)
+{
+	rules.Clear();
+	try
+	{
+		char numBuff[32];
+		TIMESTAMP startTime = GetTimeStamp();
+		if (paths.empty() || !InitYara())
+			return FALSE;
+
+		RULE_UNITS units;
+		GetUnits(paths, units);
+
+		// The background compile of the default rules started at plugin load
+		JoinPrecompile(&units);
+
+		// Drop the resident sets that are no longer wanted, or changed on disk
+		UINT32 resident = 0;
+		for (auto it = residentSets.begin(); it != residentSets.end();)
+		{
+			if (Wanted(units, *it) && SourcesCurrent(it->sources))
+			{
+				resident++;
+				++it;
+			}
+			else
+				it = residentSets.erase(it);
+		}
+
+		// Load the rest, each in its own compiler
+		std::list<RULE_SET> loading;
+		for (const RULE_UNIT &unit : units)
+		{
+			BOOL have = FALSE;
+			for (RULE_SET &set : residentSets)
+			{
+				if (SameUnit(set, unit))
+				{
+					have = TRUE;
+					break;
+				}
+			}
+			if (!have)
+				loading.emplace_back(unit);
+		}
+
+		TIMESTAMP loadTime = GetTimeStamp();
+		includeCache.ResetStats();
+		if (!loading.empty())
+		{
+			LoadSets(loading);
+
+			// If a split index file's units don't compile on their own (like rules referencing rules in another of
+			// its files), or have the same rule identifier in more than one, compile that file whole instead
+			for (const qstring &path : paths)
+			{
+				BOOL split = FALSE, failed = FALSE;
+				for (RULE_SET &set : loading)
+				{
+					if (_stricmp(set.ns.c_str(), path.c_str()) == 0)
+					{
+						split |= (_stricmp(set.path.c_str(), path.c_str()) != 0);
+						failed |= (set.rules == NULL);
+					}
+				}
+				if (!split || !(failed || DuplicateIdentifiers(path.c_str(), loading)))
+					continue;
+
+				msg("\"%s\" doesn't compile as separate files, compiling it whole\n", PathFindFileNameA(path.c_str()));
+				wholeFiles.push_back(path);
+				for (auto it = residentSets.begin(); it != residentSets.end();)
+				{
+					if (_stricmp(it->ns.c_str(), path.c_str()) == 0)
+						it = residentSets.erase(it);
+					else
+						++it;
+				}
+				for (auto it = loading.begin(); it != loading.end();)
+				{
+					if (_stricmp(it->ns.c_str(), path.c_str()) == 0)
+						it = loading.erase(it);
+					else
+						++it;
+				}
+				std::list<RULE_SET> whole;
+				RULE_UNIT unit = { path, path };
+				whole.emplace_back(unit);
+				LoadSets(whole);
+				loading.splice(loading.end(), whole);
+
+				RULE_UNITS::iterator first = units.end();
+				for (RULE_UNITS::iterator it = units.begin(); it != units.end();)
+				{
+					if (_stricmp(it->ns.c_str(), path.c_str()) == 0)
+					{
+						if (first == units.end())
+						{
+							// Same place in the order
+							it->path = path;
+							first = it++;
+						}
+						else
+							it = units.erase(it);
+					}
+					else
+						++it;
+				}
+			}
+
+			// Their output in unit order
+			for (RULE_SET &set : loading)
+				DumpMessages(set);
+		}
+
+		// The loaded sets join the resident ones, even when another failed, so a rerun only redoes the failure
+		BOOL failed = FALSE;
+		UINT32 images = 0, cached = 0, compiled = 0;
+		for (auto it = loading.begin(); it != loading.end();)
+		{
+			if (it->rules)
+			{
+				if (it->image)
+					images++;
+				else
+				if (it->cached)
+					cached++;
+				else
+					compiled++;
+				residentSets.splice(residentSets.end(), loading, it++);
+			}
+			else
+			{
+				failed = TRUE;
+				++it;
+			}
+		}
+		if (images || cached || compiled || (units.size() > 1))
+			msg("%u rule unit(s): %u resident, %u from rule images, %u from the compiled cache, %u recompiled; loaded in %s\n", (UINT32) units.size(), resident, images, cached, compiled, TimeString(GetTimeStamp() - loadTime));
+		else
+			msg("Rules resident, checked in %s\n", TimeString(GetTimeStamp() - startTime));
+		if (optionVerbose && (includeCache.Hits() || includeCache.Misses()))
+			msg(" Include cache: %u hits, %u reads, %s\n", includeCache.Hits(), includeCache.Misses(), byteSizeString(includeCache.MemoryUsed()));
+		if (failed)
+			return FALSE;
+
+		// In the selection order
+		for (const RULE_UNIT &unit : units)
+		{
+			for (RULE_SET &set : residentSets)
+			{
+				if (SameUnit(set, unit))
+				{
+					rules.Add(set.rules, set.ns.c_str());
+					break;
+				}
+			}
+		}
+		msg("%s rules loaded, from %u rule set(s)\n", NumberCommaString(rules.Count(), numBuff), (UINT32) rules.sets.size());
+		return TRUE;
+	}
+	CATCH()
+	rules.Clear();
+	return FALSE;
+}
+
+void ReleaseRules()
+{
+	try
+	{
+		JoinPrecompile(NULL);
+		includeCache.Clear();
+		residentSets.clear();
+		wholeFiles.clear();
+
+		if (yaraInitalized == ERROR_SUCCESS)
+		{
+			yr_finalize();
+			yaraInitalized = -1;
+		}
+	}
+	CATCH()
+}
+
+void SetAtomQualityTable(__in_opt LPCSTR path)
+{
+	atomTablePath = (path ? path : "");
+}
+
+YR_RULES* CompileRulesUncached(__in LPCSTR path, __in_opt LPCSTR atomTable, __out_opt RULE_WARNINGS *warnings)
+{
+	YR_RULES *rules = NULL;
+	try
+	{
+		if (!InitYara())
+			return NULL;
+		RULE_UNIT unit = { path, path };
+		RULE_SET set(unit);
+		set.atomTable = (atomTable ? atomTable : "");
+		queuedWarnings = warnings;
+		CompileRules(set);
+		rules = set.rules;
+		set.rules = NULL;
+	}
+	CATCH()
+	queuedWarnings = NULL;
+	return rules;
+}
+
+// The rules files in a folder and its subfolders
+static void GetRulesFiles(__in LPCSTR folder, __inout qstrvec_t &paths)
+{
+	qwstring pattern;
+	utf8_utf16(&pattern, folder);
+	pattern += L"\\*";
+	WIN32_FIND_DATAW fd;
+	HANDLE find = FindFirstFileW(pattern.c_str(), &fd);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		if ((wcscmp(fd.cFileName, L".") == 0) || (wcscmp(fd.cFileName, L"..") == 0))
+			continue;
+		qstring name, path(folder);
+		utf16_utf8(&name, fd.cFileName);
+		path += "\\";
+		path += name;
+
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+				GetRulesFiles(path.c_str(), paths);
+		}
+		else
+		{
+			LPCSTR extension = PathFindExtensionA(name.c_str());
+			if ((_stricmp(extension, ".yar") == 0) || (_stricmp(extension, ".yara") == 0))
+				paths.push_back(path);
+		}
+	} while (FindNextFileW(find, &fd));
+	FindClose(find);
+}
+
+UINT32 BuildRuleImages(__in LPCSTR folder)
+{
+	UINT32 built = 0;
+	try
+	{
+		if (!InitYara())
+			return 0;
+
+		qstrvec_t paths;
+		GetRulesFiles(folder, paths);
+		for (const qstring &path : paths)
+		{
+			LPCSTR name = PathFindFileNameA(path.c_str());
+			char fileFolder[MAX_PATH];
+			strncpy_s(fileFolder, sizeof(fileFolder), path.c_str(), _TRUNCATE);
+			PathRemoveFileSpecA(fileFolder);
+
+			// Index files load as their units
+			qstrvec_t includes;
+			if (ReadIndexFile(path.c_str(), fileFolder, includes))
+				continue;
+
+			// Into the fixed rule image namespace, so no build machine paths are in the image
+			TIMESTAMP startTime = GetTimeStamp();
+			RULE_UNIT unit = { path, RULE_IMAGE_NAMESPACE };
+			RULE_SET set(unit);
+			strncpy_s(set.basePath, sizeof(set.basePath), fileFolder, _TRUNCATE);
+			set.atomTable.clear();
+			CompileRules(set);
+			if (!set.rules)
+			{
+				msg(MSG_TAG "** \"%s\" failed to compile, no rule image **\n", name);
+				continue;
+			}
+			if (set.sources.size() != 1)
+			{
+				msg("\"%s\" has includes, skipped; rule images are for self contained rules files\n", name);
+				continue;
+			}
+
+			TIMESTAMP compileTime = (GetTimeStamp() - startTime);
+			if (SaveRuleImage(path.c_str(), set.sources[0].hash, set.rules))
+			{
+				msg("\"%s\": %u rules compiled in %s, rule image saved\n", name, set.rules->num_rules, TimeString(compileTime));
+				built++;
+			}
+		}
+	}
+	CATCH()
+	return built;
+}
@@ -0,0 +1,59 @@
+
+// Resident compiled rules
+#pragma once
+
+#include "stdafx.h"
+
+/*
+At plugin load the default rules start compiling on a background thread, so usually the first run only has to pick up
+the result. Its output (including any compile errors) is queued and shown by that first run.
+Each selected rules file is its own rule set, compiled in its own libyara compiler. An index file (one with only
+include directives and comments) is split into a compile unit per file it includes instead, each with its own compiled
+cache entry, so editing one file of a large rule tree only recompiles that file. The units keep the index file's
+namespace. If they don't compile separately (rules that reference rules in a sibling file), or the same rule
+identifier is in more than one of them (an error a whole compile would give), the index file is compiled whole for
+the rest of the session.
+When more than one unit needs loading they're compiled (or loaded from the compiled cache) concurrently on pool
+threads, and their output is shown in selection order after.
+The last used rule sets, along with the libyara initialization, stay loaded for the IDA session so running the
+plugin again on the same rules skips both the init and the compile (or compiled cache load).
+A set is dropped when its unit is no longer selected, or when it or any of its includes changed on disk. That's
+rechecked on every run through the include cache, by file size and last write time, and by content hash for a file
+where either changed. The compiled cache and rule image source checks go through it too. The libyara compilers are destroyed as soon as they hand over the rules.
+*/
+
+// Start compiling rules files (UTF-8 paths) on a background thread, for the next GetRules() to pick up
+void PrecompileRules(__in const qstrvec_t &paths);
+
+// Get the compiled rule sets for the root rules files (UTF-8 paths), in the same order. Returns FALSE on failure with
+// the reason logged.
+BOOL GetRules(__in const qstrvec_t &paths, __out RULE_SETS &rules);
+
+// Destroy the resident rules and finalize libyara, on plugin unload
+void ReleaseRules();
+
+// Compile with an atom quality table file (see "AtomQuality.h"), or NULL/empty for the libyara heuristic.
+// Resident sets compiled the other way are dropped on the next GetRules().
+void SetAtomQualityTable(__in_opt LPCSTR path);
+
+// Rule compile warning
+struct RULE_WARNING
+{
+	qstring rule;		// Rule identifier, empty for warnings outside of a rule
+	qstring file;
+	int line;
+	qstring message;
+};
+typedef qvector<RULE_WARNING> RULE_WARNINGS;
+
+// Compile a rules file whole, bypassing the resident sets and the compiled cache, for benchmarking and linting.
+// Optionally collects the compile warnings, whether or not the verbose option shows them.
+// The caller owns the returned rules (yr_rules_destroy()), NULL on failure with the reason logged.
+YR_RULES* CompileRulesUncached(__in LPCSTR path, __in_opt LPCSTR atomTable, __out_opt RULE_WARNINGS *warnings = NULL);
+
+// Build the rule images (see "CompiledCache.h") of the self contained rules files in a folder and its subfolders,
+// for shipping next to them. Returns the count built.
+UINT32 BuildRuleImages(__in LPCSTR folder);
+
+// Output window message, queued for the IDA thread when called from the background compile
+void RuleMsg(__in LPCSTR format, ...);
@@ -0,0 +1,285 @@
+
+// Pre-scan rule selection
+#include "stdafx.h"
+#include "RuleSelect.h"
+#include "ResultStore.h"
+
+enum TERM_TYPE
+{
+	TERM_TAG,
+	TERM_NS,
+	TERM_RULE,
+	TERM_META
+};
+
+struct SELECT_TERM
+{
+	TERM_TYPE type;
+	BOOL exclude;
+	BOOL hasValue;		// "meta:KEY=VALUE"
+	qstring name;
+	qstring value;
+	UINT32 hits;		// Rules the term matched, to report the ones that match nothing
+};
+typedef qvector<SELECT_TERM> SELECT_GROUP;
+
+BOOL GlobMatch(__in LPCSTR pattern, __in LPCSTR str)
+{
+	LPCSTR star = NULL, starStr = NULL;
+	while (*str)
+	{
+		if ((*pattern == '?') || (tolower((BYTE) *pattern) == tolower((BYTE) *str)))
+		{
+			pattern++;
+			str++;
+		}
+		else
+		if (*pattern == '*')
+		{
+			star = pattern++;
+			starStr = str;
+		}
+		else
+		if (star)
+		{
+			// Backtrack, let the last '*' take one more char
+			pattern = (star + 1);
+			str = ++starStr;
+		}
+		else
+			return FALSE;
+	}
+	while (*pattern == '*')
+		pattern++;
+	return (*pattern == 0);
+}
+
+BOOL NamespaceMatch(__in LPCSTR pattern, __in_opt LPCSTR ns)
+{
+	if (!ns)
+		return FALSE;
+	if (GlobMatch(pattern, ns))
+		return TRUE;
+	LPCSTR filename = PathFindFileNameA(ns);
+	if (GlobMatch(pattern, filename))
+		return TRUE;
+	qstring title(filename);
+	size_t dot = title.rfind('.');
+	if (dot != qstring::npos)
+	{
+		title.resize(dot);
+		return GlobMatch(pattern, title.c_str());
+	}
+	return FALSE;
+}
+
+static BOOL TermMatch(__in const SELECT_TERM &term, __in YR_RULE *rule, __in LPCSTR ns)
+{
+	switch (term.type)
+	{
+		case TERM_TAG:
+		{
+			LPCSTR tag_name;
+			yr_rule_tags_foreach(rule, tag_name)
+			{
+				if (GlobMatch(term.name.c_str(), tag_name))
+					return TRUE;
+			}
+		}
+		break;
+
+		case TERM_NS:
+		return NamespaceMatch(term.name.c_str(), ns);
+
+		case TERM_RULE:
+		return (rule->identifier && GlobMatch(term.name.c_str(), rule->identifier));
+
+		case TERM_META:
+		{
+			YR_META *meta;
+			yr_rule_metas_foreach(rule, meta)
+			{
+				if (!meta->identifier || !GlobMatch(term.name.c_str(), meta->identifier))
+					continue;
+				if (!term.hasValue)
+					return TRUE;
+
+				char buffer[32];
+				LPCSTR value;
+				if (meta->type == META_TYPE_STRING)
+					value = meta->string;
+				else
+				if (meta->type == META_TYPE_BOOLEAN)
+					value = (meta->integer ? "true" : "false");
+				else
+				{
+					_i64toa_s(meta->integer, buffer, sizeof(buffer), 10);
+					value = buffer;
+				}
+				if (value && GlobMatch(term.value.c_str(), value))
+					return TRUE;
+			}
+		}
+		break;
+	};
+	return FALSE;
+}
+
+// Parse the expression into its OR groups of AND terms
+static BOOL ParseSelection(__in LPCSTR expression, __out qvector<SELECT_GROUP> &groups, __out qstring &error)
+{
+	groups.clear();
+	qstring tmp(expression);
+	char *nextGroup = NULL;
+	for (char *groupStr = qstrtok(tmp.begin(), "|", &nextGroup); groupStr; groupStr = qstrtok(NULL, "|", &nextGroup))
+	{
+		SELECT_GROUP &group = groups.push_back();
+		char *nextTerm = NULL;
+		for (char *termStr = qstrtok(groupStr, " \t&", &nextTerm); termStr; termStr = qstrtok(NULL, " \t&", &nextTerm))
+		{
+			SELECT_TERM &term = group.push_back();
+			term.exclude = ((*termStr == '!') || (*termStr == '-'));
+			term.hasValue = FALSE;
+			term.hits = 0;
+			LPCSTR typeStr = (termStr + (term.exclude ? 1 : 0));
+
+			LPCSTR name = strpbrk(typeStr, ":=");
+			if (!name || !name[1])
+			{
+				error.sprnt("Bad selection term \"%s\", expected \"tag:\", \"ns:\", \"rule:\", or \"meta:\" and a name", termStr);
+				return FALSE;
+			}
+			size_t typeLen = (size_t) (name - typeStr);
+			name++;
+
+			if ((typeLen == 3) && (_strnicmp(typeStr, "tag", 3) == 0))
+				term.type = TERM_TAG;
+			else
+			if ((typeLen == 2) && (_strnicmp(typeStr, "ns", 2) == 0))
+				term.type = TERM_NS;
+			else
+			if ((typeLen == 4) && (_strnicmp(typeStr, "rule", 4) == 0))
+				term.type = TERM_RULE;
+			else
+			if ((typeLen == 4) && (_strnicmp(typeStr, "meta", 4) == 0))
+				term.type = TERM_META;
+			else
+			{
+				error.sprnt("Unknown selection type in \"%s\", expected \"tag:\", \"ns:\", \"rule:\", or \"meta:\"", termStr);
+				return FALSE;
+			}
+
+			term.name = name;
+			if (term.type == TERM_META)
+			{
+				size_t equals = term.name.find('=');
+				if (equals != qstring::npos)
+				{
+					term.value = term.name.substr(equals + 1);
+					term.name.resize(equals);
+					term.hasValue = TRUE;
+					if (term.name.empty())
+					{
+						error.sprnt("Bad selection term \"%s\", missing the meta name", termStr);
+						return FALSE;
+					}
+				}
+			}
+		}
+		if (group.empty())
+		{
+			error = "Empty selection term group";
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+void SelectAllRules(__in const RULE_SETS &rules)
+{
+	for (YR_RULE *rule : rules.table)
+	{
+		if (RULE_IS_DISABLED(rule))
+			yr_rule_enable(rule);
+	}
+}
+
+BOOL SelectRules(__in const RULE_SETS &rules, __in LPCSTR expression, __out UINT32 &selected, __out qstring &error)
+{
+	selected = rules.Count();
+	error.clear();
+	SelectAllRules(rules);
+
+	qvector<SELECT_GROUP> groups;
+	if (!ParseSelection(expression, groups, error))
+		return FALSE;
+	if (groups.empty())
+		return TRUE;
+
+	// Rule state is per rule, not per scan, so it sticks with the resident rules until the next selection
+	selected = 0;
+	for (UINT32 i = 0; i < rules.Count(); i++)
+	{
+		YR_RULE *rule = rules.Rule(i);
+
+		// Every term is tried (no short circuit) so the term hit counts are complete
+		BOOL select = FALSE;
+		for (SELECT_GROUP &group : groups)
+		{
+			BOOL all = TRUE;
+			for (SELECT_TERM &term : group)
+			{
+				BOOL match = TermMatch(term, rule, rules.Namespace(i));
+				if (match)
+					term.hits++;
+				if (match == term.exclude)
+					all = FALSE;
+			}
+			select |= all;
+		}
+
+		if (select)
+			selected++;
+		else
+			yr_rule_disable(rule);
+	}
+
+	// A term that matches nothing is most likely a typo
+	for (const SELECT_GROUP &group : groups)
+	{
+		for (const SELECT_TERM &term : group)
+		{
+			if (!term.exclude && (term.hits == 0))
+				msg(MSG_TAG "* No rules match selection term \"%s\" *\n", term.name.c_str());
+		}
+	}
+	return TRUE;
+}
+
+UINT32 DisableDuplicateRules(__in const RULE_SETS &rules)
+{
+	UINT32 disabled = 0;
+	std::map<UINT64, UINT32> seen; // Rule hash to its rule set index
+	for (UINT32 set = 0; set < (UINT32) rules.sets.size(); set++)
+	{
+		UINT32 end = (((set + 1) < (UINT32) rules.sets.size()) ? rules.bases[set + 1] : rules.Count());
+		for (UINT32 i = rules.bases[set]; i < end; i++)
+		{
+			YR_RULE *rule = rules.Rule(i);
+			if (RULE_IS_DISABLED(rule))
+				continue;
+
+			UINT64 hash = HashRule(rule);
+			auto it = seen.find(hash);
+			if (it == seen.end())
+				seen[hash] = set;
+			else
+			if (it->second != set)
+			{
+				yr_rule_disable(rule);
+				disabled++;
+			}
+		}
+	}
+	return disabled;
+}
@@ -0,0 +1,41 @@
+
+// Pre-scan rule selection
+#pragma once
+
+#include "stdafx.h"
+
+/*
+Picks the subset of the loaded rules to scan with by setting each rule's libyara enabled state
+(yr_rule_enable() / yr_rule_disable()), so changing the selection never needs a recompile.
+Disabled rules have their strings skipped by the scanner, so a small subset also scans faster on atom heavy sets.
+
+Selection expressions use the same shape as the match filter: space or '&' separated terms are ANDed,
+'|' separated groups are ORed. A '!' or '-' term prefix excludes. Names are case insensitive '*' and '?' globs.
+ "tag:NAME"        Rule has a matching tag.
+ "ns:NAME"         Namespace matches; the rules file path, its file name, or its file name without extension.
+ "rule:NAME"       Rule identifier matches.
+ "meta:KEY"        Rule has the meta. "meta:KEY=VALUE" the meta value matches (integers as decimal, booleans
+                   as "true" or "false").
+'=' can stand in for the type ':' so expressions can be passed in the IDA "-O" command line options.
+  "tag:AND | ns:default -rule:*_crc*" = rules tagged AND, or the default rules that aren't CRC ones
+The rules of an index file (like the default rules) are in its namespace, not their own file's.
+An empty expression selects all the rules.
+*/
+
+// Apply a selection expression to the loaded rules, enabling the selected rules and disabling the rest.
+// Returns FALSE with the reason on a bad expression, leaving all the rules enabled.
+BOOL SelectRules(__in const RULE_SETS &rules, __in LPCSTR expression, __out UINT32 &selected, __out qstring &error);
+
+// Case insensitive '*' and '?' wildcard match
+BOOL GlobMatch(__in LPCSTR pattern, __in LPCSTR str);
+
+// Match a namespace by its rules file path, file name, or file name without the extension. Shared with the match filter.
+BOOL NamespaceMatch(__in LPCSTR pattern, __in_opt LPCSTR ns);
+
+// Enable all the loaded rules
+void SelectAllRules(__in const RULE_SETS &rules);
+
+// Disable the selected rules that duplicate an earlier selected rule in another rule set (same identifier, tags,
+// metas, and strings, see HashRule()). For rule sets known to only differ by byte order, like the mixed endian
+// signsrch defaults, where the byte order independent tables are in both. Returns the count disabled.
+UINT32 DisableDuplicateRules(__in const RULE_SETS &rules);
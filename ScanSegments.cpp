@@ -3,24 +3,27 @@
 #include "StdAfx.h"
 #include "ConcurrentCallbacks.h"
 
-extern BOOL optionPlaceComments, optionSingleThread, optionVerbose;
-extern YR_RULES *g_rules;
+extern BOOL optionPlaceComments, optionSingleThread, optionVerbose, optionSampleMatches;
+extern UINT32 optionMatchCap, optionHardLimit;
+extern RULE_SETS g_rules;
 extern LPCSTR YaraStatusString(int error);
 
 // Segment scan container
 struct SEGMENT
 {
-	segment_t *seg;
+	ea_t startEA;		// Copied on the IDA thread, the segment_t can change while scanning
+	qstring name;
+	UINT32 index;		// IDA segment number
+	UINT32 ruleBase;	// Rule table index of the rule set being scanned
 	std::vector<BYTE> buffer;
 	std::vector<MATCH> matches;
 	qstrvec_t messages;
+	UINT64 matchCount;	// Includes matches over the rule cap that were not stored
 	int cbResult;
 
 	// Called from the IDA thread only
-	SEGMENT(__in segment_t *_seg) : cbResult(ERROR_CALLBACK_ERROR)
+	SEGMENT(__in segment_t *seg, __in const qstring &_name, UINT32 _index) : startEA(seg->start_ea), name(_name), index(_index), ruleBase(0), matchCount(0), cbResult(ERROR_CALLBACK_ERROR)
 	{
-		seg = _seg;		
-
 		// Clone the segment bytes into our buffer
 		size_t segSize = seg->size();
 		buffer.resize(segSize);
@@ -57,12 +60,51 @@ struct SEGMENT
 	}
 };
 
+// Per rule match tally, shared by all of the segment scan workers
+struct RULE_TALLY
+{
+	SRWLOCK lock;
+	UINT64 seen;		// Exact match count, until disabled
+	UINT64 random;		// Reservoir sampling xorshift state
+	BOOL limited;		// Over the hard limit, its matches are only counted
+	BOOL disabled;		// yr_rule_disable()'d for the remaining segments, re-enabled after the scan
+	std::vector<MATCH> sample; // Match reservoir when sampling is on
+
+	RULE_TALLY() : seen(0), random(0), limited(FALSE), disabled(FALSE) { InitializeSRWLock(&lock); }
+
+	inline UINT64 nextRandom()
+	{
+		random ^= (random << 13);
+		random ^= (random >> 7);
+		random ^= (random << 17);
+		return random;
+	}
+};
+static RULE_TALLY *ruleTally = NULL;
+static std::vector<UINT32> limitedRules;	// Rules over the hard limit, to disable before the next segment
+static SRWLOCK limitedLock = SRWLOCK_INIT;
+static volatile LONG limitedPending = 0;
+
+// Scan job state, lives across calls for background scans
+static std::list<SEGMENT> segments;
+static ConcurrentCallbackGroup *ccg = NULL;
+static UINT64 bytesTotal = 0;
+static volatile LONG64 bytesDone = 0;	// Published by the workers per scan block, once per rule set pass
+static size_t blockOverlap = 0;			// Longest match span of the loaded rules
+#define SCAN_BLOCK_SIZE (16 * (1024 * 1024)) // Larger segments are scanned in overlapped blocks, for the progress
+static volatile LONG abortScan = FALSE;
+static TIMESTAMP scanStartTime = 0;
+static UINT32 selectedRules = 0;	// Rules enabled by the rule selection this scan
+static double allRulesRate = 0.0;	// Scan MB/s of the last scan with all of the rules, for comparing subset scans
+static UINT32 allRulesCount = 0;
 
 // YARA rule scan callback
 // Note: Not guaranteed to be IDA thread, call no IDA API functions in here
 static int YaraScanCallback(__in YR_SCAN_CONTEXT *context, int message, __in void *message_data, __in void *user_data)
 {
 	SEGMENT *seg = (SEGMENT*) user_data;
+	if (abortScan)
+		return CALLBACK_ABORT;
 
 	try
 	{		
@@ -72,18 +114,67 @@ static int YaraScanCallback(__in YR_SCAN_CONTEXT *context, int message, __in voi
 			{		
 				YR_RULE *rule = (YR_RULE*) message_data;
 				//seg->qmsg("\n Rule: \"%s\"\n", rule->identifier);
-				
+				UINT32 ruleIndex = (seg->ruleBase + (UINT32) (rule - context->rules->rules_table));
+				RULE_TALLY &tally = ruleTally[ruleIndex];
+				UINT64 cap = (optionMatchCap ? optionMatchCap : MAXUINT64);
+
+				// Once per rule per segment, so only contended when segments match the same rule concurrently
+				BOOL overLimit = FALSE;
+				AcquireSRWLockExclusive(&tally.lock);
 				YR_STRING *str;
 				yr_rule_strings_foreach(rule, str)
 				{
 					//seg->qmsg("  Str: \"%s\"\n", str->identifier);
 					YR_MATCH *match;
 					yr_string_matches_foreach(context, str, match)
-					{					
+					{
 						//seg->qmsg("   Match: offset: 0x%llX\n", match->offset);
-						seg->matches.push_back({ rule, seg->seg->start_ea + (ea_t) match->offset });
+						// A match first seen at the start of a later block is a regex cut short by the block start.
+						// Any real match there is also in the previous block's overlap, libyara keeps that one.
+						if ((match->base > 0) && (match->offset == 0))
+							continue;
+						MATCH m = { seg->startEA + (ea_t) (match->base + match->offset), ruleIndex, (UINT32) match->match_length, seg->index };
+						UINT64 n = ++tally.seen;
+						seg->matchCount++;
+
+						// Over the hard limit only count it, until it's disabled
+						if (tally.limited)
+							continue;
+						if (optionHardLimit && (n > optionHardLimit))
+						{
+							tally.limited = overLimit = TRUE;
+							continue;
+						}
+
+						// Under the cap store it, over the cap only count it unless sampling
+						if (n <= cap)
+						{
+							if (optionSampleMatches && optionMatchCap)
+								tally.sample.push_back(m);
+							else
+								seg->matches.push_back(m);
+						}
+						else
+						if (optionSampleMatches)
+						{
+							// Reservoir sampling (Algorithm R): keep with probability cap/n
+							UINT64 j = (tally.nextRandom() % n);
+							if (j < cap)
+								tally.sample[(size_t) j] = m;
+						}
 					}
-				}			
+				}
+				ReleaseSRWLockExclusive(&tally.lock);
+
+				// Runaway rule, have it disabled before the next segment so it stops costing scan time
+				if (overLimit)
+				{
+					AcquireSRWLockExclusive(&limitedLock);
+					limitedRules.push_back(ruleIndex);
+					InterlockedExchange(&limitedPending, TRUE);
+					ReleaseSRWLockExclusive(&limitedLock);
+					seg->qmsg("* Warning: Rule \"%s\" exceeded the hard limit of %u matches, disabled for the remaining segments *\n", rule->identifier, optionHardLimit);
+				}
 			}
 			break;
 
@@ -119,22 +210,150 @@ static int YaraScanCallback(__in YR_SCAN_CONTEXT *context, int message, __in voi
 	return CALLBACK_CONTINUE;
 }
 
+// Disable the rules that went over the hard limit, as a worker takes its next segment.
+// yr_rule_disable() only sets flags, a worker still scanning just sees the rule's strings as disabled part way.
+static void DisableLimitedRules()
+{
+	if (!limitedPending)
+		return;
+
+	AcquireSRWLockExclusive(&limitedLock);
+	for (UINT32 ruleIndex : limitedRules)
+	{
+		RULE_TALLY &tally = ruleTally[ruleIndex];
+		AcquireSRWLockExclusive(&tally.lock);
+		if (!tally.disabled)
+		{
+			yr_rule_disable(g_rules.Rule(ruleIndex));
+			tally.disabled = TRUE;
+		}
+		ReleaseSRWLockExclusive(&tally.lock);
+	}
+	limitedRules.clear();
+	InterlockedExchange(&limitedPending, FALSE);
+	ReleaseSRWLockExclusive(&limitedLock);
+}
+
+// Scan block iterator over a segment mirror. Blocks are SCAN_BLOCK_SIZE apart and overlap the next one by the longest
+// match span, so every match is whole in the block it starts in. libyara evaluates the conditions once after the last
+// block, the same as a single buffer scan. A block's bytes count toward the scan progress as it's done.
+struct SEGMENT_BLOCKS
+{
+	YR_MEMORY_BLOCK block;
+	const BYTE *data;
+	size_t size;
+	size_t published;	// Bytes already counted in bytesDone
+	size_t passes;		// Rule set count, for the progress
+
+	void Publish(size_t end)
+	{
+		InterlockedAdd64(&bytesDone, (LONG64) ((end - published) / passes));
+		published = end;
+	}
+};
+
+static const uint8_t* FetchBlockData(__in YR_MEMORY_BLOCK *block)
+{
+	SEGMENT_BLOCKS *blocks = (SEGMENT_BLOCKS*) block->context;
+	return (blocks->data + block->base);
+}
+
+static YR_MEMORY_BLOCK* FirstBlock(__in YR_MEMORY_BLOCK_ITERATOR *iterator)
+{
+	SEGMENT_BLOCKS *blocks = (SEGMENT_BLOCKS*) iterator->context;
+	blocks->block.base = 0;
+	blocks->block.size = min(blocks->size, (SCAN_BLOCK_SIZE + blockOverlap));
+	return &blocks->block;
+}
+
+static YR_MEMORY_BLOCK* NextBlock(__in YR_MEMORY_BLOCK_ITERATOR *iterator)
+{
+	SEGMENT_BLOCKS *blocks = (SEGMENT_BLOCKS*) iterator->context;
+	size_t base = (size_t) blocks->block.base;
+	if (((base + blocks->block.size) >= blocks->size) || abortScan)
+		return NULL;
+
+	blocks->Publish(base + SCAN_BLOCK_SIZE);
+	base += SCAN_BLOCK_SIZE;
+	blocks->block.base = base;
+	blocks->block.size = min((blocks->size - base), (SCAN_BLOCK_SIZE + blockOverlap));
+	return &blocks->block;
+}
+
+static uint64_t BlocksFileSize(__in YR_MEMORY_BLOCK_ITERATOR *iterator)
+{
+	return ((SEGMENT_BLOCKS*) iterator->context)->size;
+}
+
 static BOOL SegmentScanWorker(__in PVOID lParm)
 {
 	//trace("SW start TID: %08X, core: %u\n", GetCurrentThreadId(), GetCurrentProcessorNumber());
 	SEGMENT &seg = *((SEGMENT*) lParm);
-	seg.cbResult = yr_rules_scan_mem(g_rules, seg.buffer.data(), seg.buffer.size(), SCAN_FLAGS_REPORT_RULES_MATCHING, YaraScanCallback, &seg, 0);
+	DisableLimitedRules();
+
+	// Every rule set scans the segment here in turn, while its mirror is still hot in the cache
+	size_t passes = g_rules.sets.size();
+	for (size_t i = 0; (i < passes) && !abortScan; i++)
+	{
+		seg.ruleBase = g_rules.bases[i];
+		if (seg.buffer.size() <= SCAN_BLOCK_SIZE)
+		{
+			seg.cbResult = yr_rules_scan_mem(g_rules.sets[i], seg.buffer.data(), seg.buffer.size(), SCAN_FLAGS_REPORT_RULES_MATCHING, YaraScanCallback, &seg, 0);
+			InterlockedAdd64(&bytesDone, (LONG64) (seg.buffer.size() / passes));
+		}
+		else
+		{
+			SEGMENT_BLOCKS blocks = { { 0, 0, NULL, FetchBlockData }, seg.buffer.data(), seg.buffer.size(), 0, passes };
+			blocks.block.context = &blocks;
+			YR_MEMORY_BLOCK_ITERATOR iterator = { &blocks, FirstBlock, NextBlock, BlocksFileSize, ERROR_SUCCESS };
+			seg.cbResult = yr_rules_scan_mem_blocks(g_rules.sets[i], &iterator, SCAN_FLAGS_REPORT_RULES_MATCHING, YaraScanCallback, &seg, 0);
+			blocks.Publish(blocks.size);
+		}
+		if (seg.cbResult != ERROR_SUCCESS)
+			break;
+	}
+
+	// Free the segment mirror now that it's done with
+	std::vector<BYTE>().swap(seg.buffer);
 	//trace("SW done TID: %08X, core: %u\n", GetCurrentThreadId(), GetCurrentProcessorNumber());
 	return seg.cbResult != ERROR_SUCCESS;	
 }
 
-// YARA scan IDB memory segments, called from IDA thread
+// Stop and release the scan job
+static void ReleaseScanJob()
+{
+	if (ccg)
+	{
+		if (optionVerbose)		
+			msg("Destructing ConcurrentCallbackGroup object.\n");		
+		delete ccg;
+		ccg = NULL;
+	}
+	if (ruleTally)
+	{
+		// The rules are resident, put back the ones the hard limit disabled
+		for (UINT32 i = 0; i < g_rules.Count(); i++)
+		{
+			if (ruleTally[i].disabled)
+				yr_rule_enable(g_rules.Rule(i));
+		}
+		delete[] ruleTally;
+		ruleTally = NULL;
+	}
+	limitedRules.clear();
+	limitedPending = FALSE;
+	segments.clear();
+	bytesTotal = 0;
+	bytesDone = 0;
+	blockOverlap = 0;
+	abortScan = FALSE;
+}
+
+// Mirror the IDB segments and start the scan workers on them, called from IDA thread
 // Returns TRUE if user aborted or on error
-BOOL ScanSegments(__out MATCHES &matches)
+BOOL StartScan()
 {
 	BOOL aborted = TRUE;	
-	std::list<SEGMENT> segments;
-	ConcurrentCallbackGroup *ccg = NULL;
 
 	#define TRY_UPDATE_CANCEL() \
 		if (WaitBox::isUpdateTime()) \
@@ -148,6 +367,7 @@ BOOL ScanSegments(__out MATCHES &matches)
 
 	try
 	{
+		ReleaseScanJob();
 		UINT32 scanThreads = optionSingleThread ? 1 : 0;
 		if (scanThreads != 1)
 			scanThreads = ConcurrentCallbackGroup::GetPhysicalCoreCount();
@@ -155,6 +375,8 @@ BOOL ScanSegments(__out MATCHES &matches)
 			msg("\n" MSG_TAG "Using single threaded scanning.\n");
 		else
 			msg("\n" MSG_TAG "Using up to %u physical core threads for scanning.\n", scanThreads);
+		if (optionVerbose)
+			msg("Per rule match cap: %u%s, hard limit: %u (0 = none)\n", optionMatchCap, (optionSampleMatches ? " sampled" : ""), optionHardLimit);
 		
 		// Instance the callback manager
 		HRESULT hr = E_FAIL;
@@ -168,9 +390,32 @@ BOOL ScanSegments(__out MATCHES &matches)
 
 		msg("Walking segments:\n");
 		REFRESH_UI();
-		matches.clear();		
 
-		// 1) Add segments to scan
+		// Block overlap for the large segments: the longest literal string, or the longest regex or hex string match
+		// (its forward and backward scan limits)
+		blockOverlap = (2 * YR_RE_SCAN_LIMIT);
+		for (YR_RULE *rule : g_rules.table)
+		{
+			YR_STRING *str;
+			yr_rule_strings_foreach(rule, str)
+			{
+				if (STRING_IS_LITERAL(str) && ((size_t) str->length > blockOverlap))
+					blockOverlap = (size_t) str->length;
+			}
+		}
+
+		// Per rule match tallies for the match cap and hard limit
+		ruleTally = new RULE_TALLY[g_rules.Count()];
+		selectedRules = 0;
+		for (UINT32 i = 0; i < g_rules.Count(); i++)
+		{
+			ruleTally[i].random = (0x9E3779B97F4A7C15ull * (i + 1));
+			if (!RULE_IS_DISABLED(g_rules.Rule(i)))
+				selectedRules++;
+		}
+
+		// Add segments to scan
+		scanStartTime = GetTimeStamp();
 		int count = get_segm_qty();
 		for (int i = 0; i < count; i++)
 		{
@@ -207,8 +452,9 @@ BOOL ScanSegments(__out MATCHES &matches)
 						if (seg->size() > 0)
 						{
 							// Mirror segment bytes
-							segments.push_back({ seg });
+							segments.emplace_back(seg, name, (UINT32) i);
 							SEGMENT *sp = &segments.back();
+							bytesTotal += sp->buffer.size();
 
 							// Start up scanning on this segment's data
 							// Depending on the thread pool size will either start now or will be queued for later
@@ -230,23 +476,69 @@ BOOL ScanSegments(__out MATCHES &matches)
 			}
 		}
 
-		// 2) Wait for segment scans to complete..
 		msg("\nScanning:\n");
 		REFRESH_UI();
+		aborted = FALSE;
+	}
+	catch (std::exception& ex)
+	{
+		msg("StartScan(): ** C++ exception: \"%s\" **\n", ex.what());
+		aborted = TRUE;
+	}
+	catch (...)
+	{
+		msg("StartScan(): ** General C exception **\n");
+		aborted = TRUE;
+	}
 
-		Sleep(50);
-		long errorCount = 0;		
-		do
-		{			
-			// Update wait box periodically, checking if "Cancel" button was pressed
-			TRY_UPDATE_CANCEL();
+	exit:;
+	#undef TRY_UPDATE_CANCEL
+	if (aborted)
+		ReleaseScanJob();
+	return aborted;
+}
+
+// Returns TRUE once all of the segment scans are done or one failed. Safe to call from a timer.
+BOOL ScanDone()
+{
+	long errorCount = 0;
+	return (!ccg || (ccg->Poll(errorCount) != E_PENDING));
+}
+
+// Scan progress, as a percentage and ETA text from the bytes the workers have scanned so far
+int GetScanProgress(__out qstring &text)
+{
+	UINT64 done = (UINT64) bytesDone, total = bytesTotal;
+	int percent = (total ? (int) ((done * 100) / total) : 0);
+	text.sprnt("Scanning.. %d%%", percent);
+	if (done && (done < total))
+	{
+		// Linear byte throughput estimate
+		TIMESTAMP elapsed = (GetTimeStamp() - scanStartTime);
+		text.cat_sprnt(", about %s left", TimeString(elapsed * ((double) (total - done) / (double) done)));
+	}
+	return percent;
+}
 
-			Sleep(50);
-			hr = ccg->Poll(errorCount);
+// Stop a running scan and discard it. Blocks until the active segment scans return.
+void AbortScan()
+{
+	abortScan = TRUE;
+	ReleaseScanJob();
+}
 
-		} while (hr == E_PENDING);
+// Gather the results of a completed scan, called from IDA thread
+// Returns TRUE on error
+BOOL FinishScan(__out MATCHES &matches)
+{
+	BOOL aborted = TRUE;
+	matches.clear();
 
+	try
+	{
 		// Scan jobs completed
+		long errorCount = 0;
+		HRESULT hr = ccg->Poll(errorCount);
 		if (hr != ERROR_SUCCESS)
 		{
 			char buffer[1024];
@@ -259,17 +551,15 @@ BOOL ScanSegments(__out MATCHES &matches)
 		UINT32 index = 0;
 		for (SEGMENT &seg: segments)
 		{				
-			qstring name;
-			get_segm_name(&name, seg.seg);
-			msg(" [%u] \"%s\"", index++, name.c_str());
+			msg(" [%u] \"%s\"", index++, seg.name.c_str());
 			if (seg.cbResult != ERROR_SUCCESS)
 				msg(" ** Error: %s **\n", YaraStatusString(seg.cbResult));
-			if (seg.matches.empty())
+			if (seg.matchCount == 0)
 				msg("\n");
 			else
 			{
 				char buffer[32];
-				msg(", %s matches\n", NumberCommaString(seg.matches.size(), buffer));
+				msg(", %s matches\n", NumberCommaString(seg.matchCount, buffer));
 				REFRESH_UI();
 				matches.insert(std::end(matches), std::begin(seg.matches), std::end(seg.matches));
 			}
@@ -283,28 +573,57 @@ BOOL ScanSegments(__out MATCHES &matches)
 			REFRESH_UI();
 		}
 
-		WaitBox::updateAndCancelCheck();
-		if ((hr == ERROR_SUCCESS) && (errorCount == 0))
-			aborted = FALSE;
-		else
+		// Merge in the sampled rule matches, and report the rules that went over the cap or the hard limit
+		for (UINT32 i = 0; i < g_rules.Count(); i++)
 		{
-			// Now report if there was a scan error
-			char buffer[1024];
-			msg(MSG_TAG "** YARA scan failed! Reason: \"%s\", errors: %d **\n", GetErrorString(hr, buffer), errorCount);
-			REFRESH_UI();
-		}		
+			RULE_TALLY &tally = ruleTally[i];
+			if (!tally.sample.empty())
+				matches.insert(std::end(matches), std::begin(tally.sample), std::end(tally.sample));
+
+			char buffer1[32], buffer2[32];
+			if (tally.limited)
+			{
+				UINT64 kept = ((optionMatchCap && (optionMatchCap < optionHardLimit)) ? optionMatchCap : optionHardLimit);
+				msg("* Rule \"%s\" went over the hard limit, matched %s times before it was disabled, kept %s%s *\n", g_rules.Rule(i)->identifier,
+					NumberCommaString(tally.seen, buffer1), NumberCommaString(kept, buffer2), ((optionSampleMatches && (kept == optionMatchCap)) ? " (sampled)" : ""));
+			}
+			else
+			if (optionMatchCap && (tally.seen > optionMatchCap))
+			{
+				msg("* Rule \"%s\" matched %s times, kept %s%s *\n", g_rules.Rule(i)->identifier, NumberCommaString(tally.seen, buffer1),
+					NumberCommaString(optionMatchCap, buffer2), (optionSampleMatches ? " (sampled)" : ""));
+			}
+		}
 
+		TIMESTAMP scanTime = (GetTimeStamp() - scanStartTime);
+		msg("Scanned %s in %s", byteSizeString(bytesTotal), TimeString(scanTime));
+		double rate = ((scanTime > 0.0) ? (((double) bytesTotal / (1024.0 * 1024.0)) / scanTime) : 0.0);
+		if (rate > 0.0)
+			msg(", %.1f MB/s", rate);
+		if (selectedRules < g_rules.Count())
+		{
+			// How the selected subset compares to the last full rule set scan
+			msg(" with %u of %u rules selected", selectedRules, g_rules.Count());
+			if ((allRulesCount == g_rules.Count()) && (allRulesRate > 0.0) && (rate > 0.0))
+				msg(", %.2fx the %.1f MB/s all rules rate", (rate / allRulesRate), allRulesRate);
+		}
+		else
+		{
+			allRulesRate = rate;
+			allRulesCount = g_rules.Count();
+		}
+		msg("\n");
 		msg("\n");
 		aborted = FALSE;
 	}
 	catch (std::exception& ex)
 	{
-		msg("ScanSegments(): ** C++ exception: \"%s\" **\n", ex.what());
+		msg("FinishScan(): ** C++ exception: \"%s\" **\n", ex.what());
 		aborted = TRUE;
 	}
 	catch (...)
 	{
-		msg("ScanSegments(): ** General C exception **\n");
+		msg("FinishScan(): ** General C exception **\n");
 		aborted = TRUE;
 	}
 
@@ -315,16 +634,39 @@ BOOL ScanSegments(__out MATCHES &matches)
 	{
 		matches.reserve(matches.size());
 		std::sort(matches.begin(), matches.end(), MATCH());
-		WaitBox::updateAndCancelCheck();
-	}
-	if (ccg)
-	{
-		if (optionVerbose)		
-			msg("Destructing ConcurrentCallbackGroup object.\n");		
-		delete ccg;
-		ccg = NULL;
 	}
-	
+	ReleaseScanJob();
 	REFRESH_UI();
 	return aborted;
 }
+
+// YARA scan IDB memory segments, blocking with a progress wait box. Called from IDA thread
+// Returns TRUE if user aborted or on error
+BOOL ScanSegments(__out MATCHES &matches)
+{
+	matches.clear();
+	if (StartScan())
+		return TRUE;
+
+	// Wait for segment scans to complete, updating the wait box periodically and checking if "Cancel" was pressed
+	Sleep(50);
+	while (!ScanDone())
+	{
+		if (WaitBox::isUpdateTime())
+		{
+			qstring text;
+			int percent = GetScanProgress(text);
+			WaitBox::setLabelText(text.c_str());
+			if (WaitBox::updateAndCancelCheck(percent))
+			{
+				msg("* Canceled *\n");
+				AbortScan();
+				return TRUE;
+			}
+		}
+		Sleep(50);
+	}
+
+	WaitBox::updateAndCancelCheck(100);
+	return FinishScan(matches);
+}
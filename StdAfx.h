@@ -64,11 +64,51 @@
 #define REFRESH_UI() { WaitBox::processIdaEvents(); }
 
 // Chooser match container
+// Packed to 20 bytes from 24, it's the bulk of our memory with very large result sets
+#pragma pack(push, 4)
 struct MATCH
 {
-	YR_RULE* rule;
 	ea_t address;	// RVA
+	UINT32 rule;	// Rule table index
+	UINT32 length;	// Match byte length
+	UINT32 segment;	// IDA segment number, see SegmentTable
 
-	bool operator()(MATCH const& a, MATCH const& b) { return a.address < b.address; }
+	// Address then rule order
+	bool operator()(MATCH const& a, MATCH const& b) { return (a.address < b.address) || ((a.address == b.address) && (a.rule < b.rule)); }
 };
+#pragma pack(pop)
 typedef std::vector<MATCH> MATCHES;
+
+// The loaded YARA rule sets, one per rules file, scanned together in one pass.
+// Matches index the rules of all the sets as one rule table, in set order.
+// A rule's namespace name comes from its set, not its YR_NAMESPACE, as rule images are built into a fixed one.
+struct RULE_SETS
+{
+	qvector<YR_RULES*> sets;
+	qvector<UINT32> bases;		// Each set's first rule table index
+	qvector<YR_RULE*> table;	// Rule table
+	qvector<LPCSTR> namespaces;	// Rule table namespace names, valid while the set is loaded
+
+	void Add(__in YR_RULES *rules, __in LPCSTR ns)
+	{
+		sets.push_back(rules);
+		bases.push_back((UINT32) table.size());
+		YR_RULE *rule;
+		yr_rules_foreach(rules, rule)
+		{
+			table.push_back(rule);
+			namespaces.push_back(ns);
+		}
+	}
+	void Clear()
+	{
+		sets.clear();
+		bases.clear();
+		table.clear();
+		namespaces.clear();
+	}
+	BOOL Empty() const { return sets.empty(); }
+	UINT32 Count() const { return (UINT32) table.size(); }
+	YR_RULE* Rule(UINT32 index) const { return table[index]; }
+	LPCSTR Namespace(UINT32 index) const { return namespaces[index]; }
+};